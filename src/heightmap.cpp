@@ -0,0 +1,145 @@
+#include "heightmap.h"
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+/// elements handed to a thread at a time by range() and quantize()
+static const size_t chunkSize = 1 << 16;
+
+static uint32_t
+nChunks( size_t n )
+{
+    return (n + chunkSize - 1) / chunkSize;
+}
+
+bool
+HeightMap::range( const float *in, size_t n, float &min, float &max,
+        ThreadPool &pool )
+{
+    std::vector< float > mins( nChunks( n ) ), maxs( nChunks( n ) );
+    pool.parallelFor( nChunks( n ), [&]( uint32_t chunk ){
+        const float *p = in + chunk * chunkSize;
+        const float *end = in + std::min( n, (chunk + 1) * chunkSize );
+        float lo = std::numeric_limits< float >::infinity(), hi = -lo;
+#ifdef __SSE2__
+        // minps and maxps return their second operand when either is NaN,
+        // so NaNs never make it into the running values
+        __m128 vlo = _mm_set1_ps( lo ), vhi = _mm_set1_ps( hi );
+        for( ; p + 4 <= end; p += 4 ){
+            __m128 v = _mm_loadu_ps( p );
+            vlo = _mm_min_ps( v, vlo );
+            vhi = _mm_max_ps( v, vhi );
+        }
+        float l[ 4 ], h[ 4 ];
+        _mm_storeu_ps( l, vlo );
+        _mm_storeu_ps( h, vhi );
+        for( int i = 0; i < 4; ++i ){
+            lo = std::min( lo, l[ i ] );
+            hi = std::max( hi, h[ i ] );
+        }
+#endif
+        for( ; p < end; ++p ){
+            if( *p < lo ) lo = *p;
+            if( *p > hi ) hi = *p;
+        }
+        mins[ chunk ] = lo;
+        maxs[ chunk ] = hi;
+    } );
+
+    min = std::numeric_limits< float >::infinity();
+    max = -min;
+    for( size_t i = 0; i < mins.size(); ++i ){
+        min = std::min( min, mins[ i ] );
+        max = std::max( max, maxs[ i ] );
+    }
+    return min <= max;
+}
+
+/// source index and weight of the next one for each destination sample
+static void
+taps( int sourceSize, int size, std::vector< int > &index,
+        std::vector< float > &weight )
+{
+    index.resize( size );
+    weight.resize( size );
+    double step = size > 1 ? double( sourceSize - 1 ) / (size - 1) : 0.0;
+    for( int i = 0; i < size; ++i ){
+        double x = i * step;
+        index[ i ] = std::max( 0, std::min( int( x ), sourceSize - 2 ) );
+        weight[ i ] = x - index[ i ];
+    }
+}
+
+void
+HeightMap::resample( const float *in, int sw, int sh,
+        float *out, int dw, int dh, ThreadPool &pool )
+{
+    std::vector< int > xi, yi;
+    std::vector< float > xw, yw;
+    taps( sw, dw, xi, xw );
+    taps( sh, dh, yi, yw );
+
+    // rows first, sh x dw
+    std::vector< float > rows( (size_t)sh * dw );
+    pool.parallelFor( sh, [&]( uint32_t y ){
+        const float *src = in + (size_t)y * sw;
+        float *dst = rows.data() + (size_t)y * dw;
+        for( int x = 0; x < dw; ++x ){
+            const float *s = src + xi[ x ];
+            dst[ x ] = sw > 1 ? s[ 0 ] + (s[ 1 ] - s[ 0 ]) * xw[ x ] : s[ 0 ];
+        }
+    } );
+
+    // then columns, a whole row of the output at a time
+    pool.parallelFor( dh, [&]( uint32_t y ){
+        const float *a = rows.data() + (size_t)yi[ y ] * dw;
+        const float *b = sh > 1 ? a + dw : a;
+        float w = yw[ y ];
+        float *dst = out + (size_t)y * dw;
+        for( int x = 0; x < dw; ++x ) dst[ x ] = a[ x ] + (b[ x ] - a[ x ]) * w;
+    } );
+}
+
+void
+HeightMap::quantize( const float *in, size_t n, float floor, float ceiling,
+        uint16_t *out, ThreadPool &pool )
+{
+    const float scale = ceiling > floor ? 65535.0f / (ceiling - floor) : 0.0f;
+    pool.parallelFor( nChunks( n ), [=]( uint32_t chunk ){
+        size_t i = chunk * chunkSize;
+        size_t end = std::min( n, i + chunkSize );
+#ifdef __SSE2__
+        const __m128 vfloor = _mm_set1_ps( floor );
+        const __m128 vscale = _mm_set1_ps( scale );
+        const __m128 half = _mm_set1_ps( 0.5f );
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 top = _mm_set1_ps( 65535.0f );
+        // SSE2 only packs signed, so shift into int16 range and back
+        const __m128i bias = _mm_set1_epi32( 32768 );
+        const __m128i flip = _mm_set1_epi16( (short)0x8000 );
+        for( ; i + 8 <= end; i += 8 ){
+            __m128 a = _mm_loadu_ps( in + i );
+            __m128 b = _mm_loadu_ps( in + i + 4 );
+            a = _mm_add_ps( _mm_mul_ps( _mm_sub_ps( a, vfloor ), vscale ), half );
+            b = _mm_add_ps( _mm_mul_ps( _mm_sub_ps( b, vfloor ), vscale ), half );
+            // NaN fails maxps and becomes zero
+            a = _mm_min_ps( _mm_max_ps( a, zero ), top );
+            b = _mm_min_ps( _mm_max_ps( b, zero ), top );
+            __m128i ia = _mm_sub_epi32( _mm_cvttps_epi32( a ), bias );
+            __m128i ib = _mm_sub_epi32( _mm_cvttps_epi32( b ), bias );
+            __m128i packed = _mm_xor_si128( _mm_packs_epi32( ia, ib ), flip );
+            _mm_storeu_si128( (__m128i *)(out + i), packed );
+        }
+#endif
+        for( ; i < end; ++i ){
+            float v = (in[ i ] - floor) * scale + 0.5f;
+            if(! (v > 0.0f) ) v = 0.0f;
+            out[ i ] = std::min( v, 65535.0f );
+        }
+    } );
+}
@@ -0,0 +1,34 @@
+#ifndef HEIGHTMAP_H
+#define HEIGHTMAP_H
+
+#include "threadpool.h"
+
+#include <cstddef>
+#include <cstdint>
+
+/// Floating point heightmap import
+/** Heights arrive as floats in world units, smf files store them as UINT16
+ *  spread between the floor and the ceiling of the map. Every step works
+ *  on rows or chunks spread over the pool.
+ */
+namespace HeightMap
+{
+    /// lowest and highest of n heights, NaNs are skipped
+    /*  returns false when there are no heights that are not NaN
+     */
+    bool range( const float *in, size_t n, float &min, float &max,
+            ThreadPool &pool );
+
+    /// bilinear resample, corner to corner as smf heightmaps are sampled
+    /*  Separable, the rows are filtered first then the columns, each pass
+     *  spread over the pool.
+     */
+    void resample( const float *in, int sw, int sh,
+            float *out, int dw, int dh, ThreadPool &pool );
+
+    /// map heights from [floor, ceiling] onto [0, 65535], rounded and clamped
+    void quantize( const float *in, size_t n, float floor, float ceiling,
+            uint16_t *out, ThreadPool &pool );
+}
+
+#endif //HEIGHTMAP_H
@@ -0,0 +1,338 @@
+#include "mapconvd.h"
+#include "smf.h"
+#include "tiledimage.h"
+
+#include "optionparser/optionparser.h"
+#include "elog/elog.h"
+
+#include <OpenImageIO/imagebuf.h>
+
+#include <cerrno>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+using namespace std;
+OIIO_NAMESPACE_USING;
+
+// Argument tests //
+////////////////////
+struct Arg: public option::Arg
+{
+    static void printError(const char* msg1, const option::Option& opt,
+            const char* msg2)
+    {
+        fprintf(stderr, "%s", msg1);
+        fwrite(opt.name, opt.namelen, 1, stderr);
+        fprintf(stderr, "%s", msg2);
+    }
+
+    static option::ArgStatus Unknown(const option::Option& option, bool msg)
+    {
+        if (msg) printError("Unknown option '", option, "'\n");
+        return option::ARG_ILLEGAL;
+    }
+
+    static option::ArgStatus Required(const option::Option& option, bool msg)
+    {
+        if (option.arg != 0)
+            return option::ARG_OK;
+
+        if (msg) printError("Option '", option, "' requires an argument\n");
+        return option::ARG_ILLEGAL;
+    }
+};
+
+enum optionsIndex
+{
+    UNKNOWN,
+    HELP,
+    SOCKET,
+    TILEMAP
+};
+
+const option::Descriptor usage[] = {
+    { UNKNOWN, 0, "", "", Arg::None,
+        "USAGE: mapconvd [options] [source files] \n"
+        "  eg. 'mapconvd --socket=/tmp/mapconv.sock --tilemap=mymap.smf "
+            "mymap.smf'\n"
+        "\nKeeps the tiles and tilemap loaded and answers requests for "
+        "regions, tiles and the tilemap over a unix domain socket, see "
+        "mapconvd.h for the protocol.\n"
+        "\nGENERAL OPTIONS:" },
+    { HELP, 0, "h", "help", Arg::None,
+        "  -h,  \t--help  \tPrint usage and exit." },
+    { SOCKET, 0, "", "socket", Arg::Required,
+        "\t--socket=mapconv.sock  \tPath of the socket to listen on." },
+    { TILEMAP, 0, "", "tilemap", Arg::Required,
+        "\t--tilemap=map.smf  \tSmf, csv or binary tilemap file to take "
+            "the tilemap from, otherwise the tiles are laid out in a "
+            "square." },
+    { 0, 0, 0, 0, 0, 0 }
+};
+
+// Socket helpers
+// ==============
+static bool
+readAll( int fd, void *data, size_t size )
+{
+    char *p = (char *)data;
+    while( size ){
+        ssize_t n = read( fd, p, size );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool
+writeAll( int fd, const void *data, size_t size )
+{
+    const char *p = (const char *)data;
+    while( size ){
+        ssize_t n = write( fd, p, size );
+        if( n < 0 && errno == EINTR ) continue;
+        if( n <= 0 ) return false;
+        p += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool
+respond( int fd, MapConvD::Response &response,
+        const void *payload = NULL, uint32_t bytes = 0 )
+{
+    response.bytes = bytes;
+    return writeAll( fd, &response, sizeof(response) )
+        && writeAll( fd, payload, bytes );
+}
+
+// Requests
+// ========
+/// clamp args x1, y1, x2, y2 to a width x height image, as TiledImage does
+/*  Returns false when the region is empty, or when its payload at
+ *  bitsPerPixel would not fit in Response::bytes.
+ */
+static bool
+clampRegion( uint32_t *args, uint32_t width, uint32_t height,
+        uint32_t bitsPerPixel )
+{
+    if( args[ 2 ] == 0 || args[ 2 ] > width ) args[ 2 ] = width;
+    if( args[ 3 ] == 0 || args[ 3 ] > height ) args[ 3 ] = height;
+    if( args[ 0 ] >= args[ 2 ] || args[ 1 ] >= args[ 3 ] ) return false;
+
+    uint64_t bits = (uint64_t)(args[ 2 ] - args[ 0 ])
+        * (args[ 3 ] - args[ 1 ]) * bitsPerPixel;
+    return bits / 8 <= UINT32_MAX;
+}
+
+/// answer a single request, returns false when the client has gone
+static bool
+answer( TiledImage &tiledImage, int fd, MapConvD::Request &request )
+{
+    MapConvD::Response response;
+    response.op = request.op;
+    uint32_t *args = request.args;
+
+    // mips index the levels stored in smt files, and shift tile sizes
+    uint32_t mip = request.op == MapConvD::TILE ? args[ 1 ]
+        : request.op == MapConvD::REGION ? args[ 4 ] : 0;
+    if( mip >= MapConvD::nMips ){
+        response.status = MapConvD::FAILED;
+        return respond( fd, response );
+    }
+
+    switch( request.op ){
+        case MapConvD::INFO: {
+            uint32_t info[] = {
+                tiledImage.pw, tiledImage.ph, tiledImage.tw, tiledImage.th,
+                tiledImage.mw, tiledImage.mh,
+                tiledImage.tileCache.getNTiles() };
+            return respond( fd, response, info, sizeof(info) );
+        }
+        case MapConvD::TILE: {
+            uint32_t w = tiledImage.tw >> args[ 1 ];
+            uint32_t h = tiledImage.th >> args[ 1 ];
+            ImageBuf *tile = tiledImage.tileCache.getScaled(
+                    args[ 0 ], w, h, args[ 1 ] );
+            if(! tile ) break;
+
+            vector< char > pixels( w * h * 4 );
+            tile->get_pixels( ROI( 0, w, 0, h, 0, 1, 0, 4 ),
+                    TypeDesc::UINT8, pixels.data() );
+            delete tile;
+            response.width = w;
+            response.height = h;
+            return respond( fd, response, pixels.data(), pixels.size() );
+        }
+        case MapConvD::TILE_DXT1: {
+            uint32_t w = tiledImage.tw;
+            vector< char > blocks( (w * w) / 2 );
+            if(! tiledImage.tileCache.getDXT1( args[ 0 ], w, blocks.data() ) )
+                break;
+            response.width = response.height = w;
+            return respond( fd, response, blocks.data(), blocks.size() );
+        }
+        case MapConvD::REGION: {
+            if(! clampRegion( args, tiledImage.mw * (tiledImage.tw >> mip),
+                        tiledImage.mh * (tiledImage.th >> mip), 32 ) ) break;
+            ImageBuf *region = tiledImage.getRegion(
+                    args[ 0 ], args[ 1 ], args[ 2 ], args[ 3 ], args[ 4 ] );
+            const ImageSpec &spec = region->spec();
+            response.width = spec.width;
+            response.height = spec.height;
+            bool good = respond( fd, response, region->localpixels(),
+                    spec.image_bytes() );
+            delete region;
+            return good;
+        }
+        case MapConvD::REGION_DXT1: {
+            if(! clampRegion( args, tiledImage.pw, tiledImage.ph, 4 ) ) break;
+            stringstream blocks;
+            if(! tiledImage.exportDXT1( blocks,
+                        args[ 0 ], args[ 1 ], args[ 2 ], args[ 3 ] ) ) break;
+            response.width = args[ 2 ] - args[ 0 ];
+            response.height = args[ 3 ] - args[ 1 ];
+            string data = blocks.str();
+            return respond( fd, response, data.data(), data.size() );
+        }
+        case MapConvD::TILEMAP:
+            response.width = tiledImage.mw;
+            response.height = tiledImage.mh;
+            return respond( fd, response, tiledImage.tileMap.data(),
+                    tiledImage.mw * tiledImage.mh * 4 );
+        default:
+            response.status = MapConvD::UNKNOWN_OP;
+            return respond( fd, response );
+    }
+
+    response.status = MapConvD::FAILED;
+    return respond( fd, response );
+}
+
+/// answer requests from one client until it disconnects
+static void
+serve( TiledImage *tiledImage, int fd )
+{
+    MapConvD::Request request;
+    while( readAll( fd, &request, sizeof(request) ) ){
+        bool connected;
+        try {
+            connected = answer( *tiledImage, fd, request );
+        }
+        catch( std::exception &e ){
+            // failed CHECKs on out of range requests end up here
+            MapConvD::Response response;
+            response.op = request.op;
+            response.status = MapConvD::FAILED;
+            connected = respond( fd, response );
+        }
+        if(! connected ) break;
+    }
+    close( fd );
+}
+
+int
+main( int argc, char **argv )
+{
+    // Option parsing
+    // ==============
+    argc -= (argc > 0); argv += (argc > 0);
+    option::Stats stats( usage, argc, argv );
+    option::Option* options = new option::Option[ stats.options_max ];
+    option::Option* buffer = new option::Option[ stats.buffer_max ];
+    option::Parser parse( usage, argc, argv, options, buffer );
+
+    bool fail = false;
+    for( option::Option* opt = options[ UNKNOWN ]; opt; opt = opt->next() ){
+        LOG(WARN) << "Unknown option: " << string( opt->name, opt->namelen );
+        fail = true;
+    }
+    if( fail ) exit( 1 );
+    if( parse.error() ) exit( 1 );
+
+    if( options[ HELP ] || argc == 0 ) {
+        int columns = getenv( "COLUMNS" ) ? atoi( getenv( "COLUMNS" ) ) : 80;
+        option::printUsage( std::cout, usage, columns );
+        exit( 1 );
+    }
+
+    // Load everything up front, its kept warm for every request.
+    // ==========================================================
+    TiledImage tiledImage;
+
+    vector< string > sources;
+    for( int i = 0; i < parse.nonOptionsCount(); ++i ){
+        sources.push_back( parse.nonOption( i ) );
+    }
+    tiledImage.tileCache.addSources( sources );
+    CHECK( tiledImage.tileCache.getNTiles() ) << "no tiles in cache";
+
+    if( options[ TILEMAP ] ){
+        SMF *smf = NULL;
+        if( (smf = SMF::open( options[ TILEMAP ].arg )) ){
+            TileMap *tileMap = smf->getMap();
+            tiledImage.setTileMap( *tileMap );
+            delete tileMap;
+            delete smf;
+        }
+        else {
+            tiledImage.setTileMap( TileMap( options[ TILEMAP ].arg ) );
+        }
+    }
+    else {
+        tiledImage.squareFromCache();
+    }
+
+    // Listen
+    // ======
+    string path = "mapconv.sock";
+    if( options[ SOCKET ] ) path = options[ SOCKET ].arg;
+
+    sockaddr_un address;
+    memset( &address, 0, sizeof(address) );
+    address.sun_family = AF_UNIX;
+    CHECK( path.size() < sizeof(address.sun_path) )
+        << "socket path is too long: " << path;
+    strncpy( address.sun_path, path.c_str(), sizeof(address.sun_path) - 1 );
+
+    int server = socket( AF_UNIX, SOCK_STREAM, 0 );
+    unlink( path.c_str() );
+    if( server < 0
+            || bind( server, (sockaddr *)&address, sizeof(address) ) < 0
+            || listen( server, 16 ) < 0 ){
+        LOG(FATAL) << "cannot listen on " << path << ": " << strerror( errno );
+    }
+
+    // clients that hang up mid response should not take the server down
+    signal( SIGPIPE, SIG_IGN );
+
+    LOG(INFO) << "Serving " << tiledImage.pw << "x" << tiledImage.ph
+        << " from " << tiledImage.tileCache.getNTiles() << " tiles on "
+        << path;
+
+    while( true ){
+        int client = accept( server, NULL, NULL );
+        if( client < 0 ){
+            if( errno == EINTR ) continue;
+            LOG(ERROR) << "accept: " << strerror( errno );
+            break;
+        }
+        std::thread( serve, &tiledImage, client ).detach();
+    }
+
+    close( server );
+    unlink( path.c_str() );
+    return 1;
+}
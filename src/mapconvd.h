@@ -0,0 +1,46 @@
+#ifndef MAPCONVD_H
+#define MAPCONVD_H
+
+#include <cstdint>
+
+/// Wire protocol of the mapconvd tile server
+/** Clients connect to the unix domain socket and send Request structures,
+ *  each one is answered with a Response followed by Response::bytes of
+ *  payload. Everything is in host byte order, the socket is local.
+ */
+namespace MapConvD
+{
+    const uint32_t nMips = 4; //< mip levels stored in smt files, 0 to 3
+
+    enum Op {
+        INFO,        //< payload: uint32_t[7] pw, ph, tw, th, mw, mh, nTiles
+        TILE,        //< args: n, mip \n payload: RGBA8 pixels of tile n
+        TILE_DXT1,   //< args: n \n payload: DXT1 blocks of tile n
+        REGION,      //< args: x1, y1, x2, y2, mip \n payload: RGBA8 pixels
+        REGION_DXT1, //< args: x1, y1, x2, y2 \n payload: DXT1 blocks
+        TILEMAP      //< payload: uint32_t[mw * mh] tile indices
+    };
+
+    enum Status {
+        OK = 0,
+        UNKNOWN_OP,  //< op is not one of the above
+        FAILED       //< request or mip out of range, or could not be read
+    };
+
+    /// Request as sent by the client, 24 bytes
+    struct Request {
+        uint32_t op = INFO;
+        uint32_t args[ 5 ] = { 0 };
+    };
+
+    /// Response header as sent by the server, 20 bytes
+    struct Response {
+        uint32_t status = OK;
+        uint32_t width = 0;  //< pixel width of an image payload
+        uint32_t height = 0; //< pixel height of an image payload
+        uint32_t op = INFO;  //< the request this answers
+        uint32_t bytes = 0;  //< size of the payload that follows
+    };
+}
+
+#endif //MAPCONVD_H
@@ -0,0 +1,41 @@
+#include "mappedfile.h"
+
+#include "elog/elog.h"
+
+#include <cerrno>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// CONSTRUCTORS
+// ============
+MappedFile::MappedFile( std::string fileName )
+{
+    int fd = open( fileName.c_str(), O_RDONLY );
+    struct stat info;
+    if( fd < 0 || fstat( fd, &info ) < 0 ){
+        LOG(ERROR) << "cannot open " << fileName << ": " << strerror( errno );
+        if( fd >= 0 ) close( fd );
+        return;
+    }
+
+    length = info.st_size;
+    if( length ){
+        void *p = mmap( NULL, length, PROT_READ, MAP_PRIVATE, fd, 0 );
+        if( p == MAP_FAILED ){
+            LOG(ERROR) << "cannot map " << fileName << ": " << strerror( errno );
+        }
+        else begin = (const char *)p;
+    }
+    opened = begin || ! length;
+    // the mapping stays valid after the descriptor is closed
+    close( fd );
+}
+
+MappedFile::~MappedFile( )
+{
+    if( begin ) munmap( (void *)begin, length );
+}
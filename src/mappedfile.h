@@ -0,0 +1,32 @@
+#ifndef MAPPEDFILE_H
+#define MAPPEDFILE_H
+
+#include <cstddef>
+#include <string>
+
+/// Read only memory mapping of a whole file
+/** The mapping lives as long as the object, so pointers into data() must
+ *  not outlive it. Empty files map to a NULL data() with a size of zero.
+ */
+class MappedFile
+{
+    // member data
+    const char *begin = NULL;
+    size_t length = 0;
+    bool opened = false;
+
+public:
+    //constructors
+    MappedFile( std::string fileName );
+    ~MappedFile( );
+
+    MappedFile( const MappedFile & ) = delete;
+    MappedFile &operator=( const MappedFile & ) = delete;
+
+    // data access
+    bool good( ){ return opened; };
+    const char *data( ){ return begin; };
+    size_t size( ){ return length; };
+};
+
+#endif //MAPPEDFILE_H
@@ -0,0 +1,90 @@
+#include "minimap.h"
+
+#include <algorithm>
+#include <vector>
+
+#include <squish.h>
+
+/// Rows of one level that map to a consecutive run of DXT1 blocks
+struct Strip {
+    uint8_t *pixels;
+    char *blocks;
+    int width;
+    int height;
+};
+
+/// cut every level into strips, 64 rows is enough to spread the top
+/// level over many threads without making the small levels tiny jobs
+static std::vector< Strip >
+strips( const std::vector< uint8_t * > &levels, char *blocks )
+{
+    const int stripHeight = 64;
+    std::vector< Strip > result;
+    int width = MiniMap::size;
+    for( auto i = levels.begin(); i != levels.end(); ++i, width >>= 1 ){
+        for( int y = 0; y < width; y += stripHeight ){
+            Strip strip;
+            strip.pixels = *i + y * width * 4;
+            strip.blocks = blocks;
+            strip.width = width;
+            strip.height = std::min( stripHeight, width - y );
+            result.push_back( strip );
+            blocks += squish::GetStorageRequirements(
+                    strip.width, strip.height, squish::kDxt1 );
+        }
+    }
+    return result;
+}
+
+void
+MiniMap::compress( const uint8_t *rgba, char *blocks, ThreadPool &pool )
+{
+    // every level below the top lives in the one scratch buffer
+    uint32_t scratchBytes = 0;
+    for( int i = 1, w = size >> 1; i < levels; ++i, w >>= 1 )
+        scratchBytes += w * w * 4;
+    std::vector< uint8_t > scratch( scratchBytes );
+
+    // the top level is only read, so it can be used in place
+    std::vector< uint8_t * > level( 1, const_cast< uint8_t * >( rgba ) );
+    uint8_t *next = scratch.data();
+    for( int i = 1, w = size >> 1; i < levels; ++i, w >>= 1 ){
+        const uint8_t *src = level.back();
+        uint8_t *dst = next;
+        const int srcRow = w * 2 * 4;
+
+        // 2x2 box filter, rounded to nearest
+        pool.parallelFor( w, [=]( uint32_t y ){
+            const uint8_t *a = src + y * 2 * srcRow;
+            const uint8_t *b = a + srcRow;
+            uint8_t *out = dst + y * w * 4;
+            for( int x = 0; x < w * 4; x += 4, a += 8, b += 8 ){
+                for( int c = 0; c < 4; ++c ){
+                    out[ x + c ] = (a[ c ] + a[ c + 4 ] + b[ c ] + b[ c + 4 ]
+                            + 2) >> 2;
+                }
+            }
+        } );
+
+        level.push_back( dst );
+        next += w * w * 4;
+    }
+
+    std::vector< Strip > work = strips( level, blocks );
+    pool.parallelFor( work.size(), [&work]( uint32_t i ){
+        squish::CompressImage( work[ i ].pixels, work[ i ].width,
+                work[ i ].height, work[ i ].blocks, squish::kDxt1 );
+    } );
+}
+
+void
+MiniMap::decompress( const char *blocks, uint8_t *rgba, ThreadPool &pool )
+{
+    // only the top level is decoded
+    std::vector< Strip > work = strips(
+            std::vector< uint8_t * >( 1, rgba ), const_cast< char * >( blocks ) );
+    pool.parallelFor( work.size(), [&work]( uint32_t i ){
+        squish::DecompressImage( work[ i ].pixels, work[ i ].width,
+                work[ i ].height, work[ i ].blocks, squish::kDxt1 );
+    } );
+}
@@ -0,0 +1,28 @@
+#ifndef MINIMAP_H
+#define MINIMAP_H
+
+#include "threadpool.h"
+
+#include <cstdint>
+
+/// Minimap as stored in smf files
+/** A 1024x1024 DXT1 image followed by its 8 mip levels, down to 4x4, for
+ *  MINIMAP_SIZE bytes in total.
+ */
+namespace MiniMap
+{
+    const int size = 1024; //< width and height of the top level
+    const int levels = 9;  //< number of levels, including the top
+
+    /// compress 1024x1024 RGBA8 pixels and their mip levels
+    /*  The mip levels are box filtered from each other in 8 bits, in a
+     *  single scratch buffer, then all levels are compressed in parallel.
+     *  blocks must hold MINIMAP_SIZE bytes.
+     */
+    void compress( const uint8_t *rgba, char *blocks, ThreadPool &pool );
+
+    /// decompress the top level into 1024x1024 RGBA8 pixels
+    void decompress( const char *blocks, uint8_t *rgba, ThreadPool &pool );
+}
+
+#endif //MINIMAP_H
@@ -1,12 +1,18 @@
 #include "config.h"
 #include "smf.h"
 #include "smt.h"
+#include "minimap.h"
+#include "heightmap.h"
 
+#include <algorithm>
+#include <cmath>
 #include <fstream>
+#include <future>
 #include <sstream>
 
+#include <unistd.h>
+
 #include "elog/elog.h"
-#include <squish.h>
 #include <OpenImageIO/imageio.h>
 #include <OpenImageIO/imagebufalgo.h>
 
@@ -75,7 +81,7 @@ SMF *SMF::open( string fileName ){
     ifstream file( fileName );
     if( file.good() ){
         file.read( magic, 16 );
-        if(! strcmp( magic, "spring map file" ) ){
+        if(! memcmp( magic, "spring map file", 16 ) ){
             good = true;
             file.close();
         }
@@ -93,8 +99,149 @@ SMF *SMF::open( string fileName ){
     return NULL;
 }
 
-/// Reads in the data from the file on disk
-/*
+// BUILDER
+// =======
+SMF::Builder::Builder( string fileName )
+    : smf( new SMF( fileName ) )
+{ }
+
+SMF::Builder::~Builder( )
+{
+    delete smf;
+}
+
+void SMF::Builder::setSize( int width, int length ){
+    smf->header.width = width * 64;
+    smf->header.length = length * 64;
+}
+
+void SMF::Builder::setDepth( float floor, float ceiling ){
+    smf->header.floor = floor;
+    smf->header.ceiling = ceiling;
+}
+
+void SMF::Builder::setTileSize( int size ){
+    smf->header.tileSize = size;
+}
+
+bool SMF::Builder::addTileFile( string fileName ){
+    return smf->addTileFile( fileName );
+}
+
+SMF *SMF::Builder::write( bool overwrite ){
+    CHECK( smf ) << "the builder has already been written";
+    string fileName = smf->fileName;
+
+    // check for existing file and whether to overwrite
+    fstream file( fileName, ios::in );
+    if( file.good() && !overwrite ) return NULL;
+    file.close();
+
+    LOG(INFO) << "INFO: Creating " << fileName;
+    file.open( fileName, ios::binary | ios::out | ios::trunc );
+    if(! file.good() ){
+        LOG(WARN) << "ERROR: Unable to write to " << fileName;
+        return NULL;
+    }
+    file.close();
+
+    // Prepare every layer at once
+    // ===========================
+    // none of them depend on the layout, only on the specs.
+    smf->updateSpecs();
+    std::future< ImageBuf * > heightJob, typeJob, metalJob, grassJob;
+    std::future< void > miniJob;
+    std::future< bool > featuresJob;
+    vector< char > miniBlocks;
+    if( mini ) miniBlocks.resize( MINIMAP_SIZE );
+
+    // declared after everything the jobs use, so it is joined first
+    ThreadPool pool;
+    // the lambdas capture a copy of the pointer rather than this
+    SMF *smf = this->smf;
+    auto prepare = [smf, &pool]( ImageBuf *buf, ImageSpec spec,
+            ResampleFilter filter ){
+        return pool.enqueue( [smf, buf, spec, filter](){
+            return smf->prepareImage( spec, buf, filter );
+        } );
+    };
+
+    if( height ){
+        ImageBuf *buf = height;
+        heightJob = pool.enqueue( [smf, buf, &pool](){
+            return smf->prepareHeight( buf, pool );
+        } );
+    }
+    if( type ) typeJob = prepare( type, smf->typeSpec, smf->typeFilter );
+    if( metal ) metalJob = prepare( metal, smf->metalSpec, smf->metalFilter );
+    if( grass ) grassJob = prepare( grass, smf->grassSpec, NEAREST );
+    if( mini ){
+        ImageBuf *buf = mini;
+        char *blocks = miniBlocks.data();
+        miniJob = pool.enqueue( [smf, buf, blocks, &pool](){
+            smf->compressMini( buf, blocks, pool );
+        } );
+    }
+    if(! featuresFile.empty() ){
+        string features = featuresFile;
+        featuresJob = pool.enqueue( [smf, features](){
+            return smf->readFeatures( features );
+        } );
+    }
+
+    ImageBuf *heightBuf = height ? heightJob.get() : NULL;
+    ImageBuf *typeBuf = type ? typeJob.get() : NULL;
+    ImageBuf *metalBuf = metal ? metalJob.get() : NULL;
+    ImageBuf *grassBuf = grass ? grassJob.get() : NULL;
+    if( mini ) miniJob.get();
+    if(! featuresFile.empty() ) featuresJob.get();
+
+    // Write it out
+    // ============
+    if( grass ){
+        smf->headerExtras.push_back( new HeaderGrass() );
+        ++smf->header.nHeaderExtras;
+    }
+    smf->updatePtrs();
+
+    // Every section is written once, in file order. Blank layers are not
+    // written at all, the gaps they leave in the new file read as zeros
+    // which is what a blank layer is.
+    smf->writeHeaders();
+    if( heightBuf ) smf->writeData( smf->header.heightPtr,
+            (char *)heightBuf->localpixels(), smf->heightSpec.image_bytes() );
+    if( typeBuf ) smf->writeData( smf->header.typePtr,
+            (char *)typeBuf->localpixels(), smf->typeSpec.image_bytes() );
+    smf->writeTileHeader();
+    if( tileMap ) smf->writeMap( tileMap );
+    if( mini ) smf->writeData( smf->header.miniPtr,
+            miniBlocks.data(), MINIMAP_SIZE );
+    if( metalBuf ) smf->writeData( smf->header.metalPtr,
+            (char *)metalBuf->localpixels(), smf->metalSpec.image_bytes() );
+    smf->writeFeaturesHeader();
+    smf->writeFeatures();
+    if( grassBuf ){
+        HeaderGrass *headerGrass = (HeaderGrass *)smf->headerExtras.back();
+        smf->writeData( headerGrass->ptr,
+            (char *)grassBuf->localpixels(), smf->grassSpec.image_bytes() );
+    }
+
+    delete heightBuf;
+    delete typeBuf;
+    delete metalBuf;
+    delete grassBuf;
+
+    smf->dirty = INT_MAX;
+    smf->init = true;
+
+    SMF *result = smf;
+    this->smf = NULL;
+    return result;
+}
+
+/// Reads the headers from the file on disk
+/*  The tile file list and the features are left for loadTiles() and
+ *  loadFeatures().
  */
 bool SMF::read(){
     int offset;
@@ -125,6 +272,20 @@ bool SMF::read(){
     }
 
     updateSpecs();
+    file.close();
+
+    // the rest is read when it is first asked for, so opening a map only
+    // costs the headers however large it is
+    tilesLoaded = false;
+    featuresLoaded = false;
+    return false;
+}
+
+void SMF::loadTiles( ){
+    if( tilesLoaded ) return;
+    tilesLoaded = true;
+
+    ifstream file( fileName );
 
     // Tileindex Information
     file.seekg( header.tilesPtr );
@@ -142,6 +303,15 @@ bool SMF::read(){
 
     // whle were at it lets get the file offset for the tilemap.
     mapPtr = file.tellg();
+}
+
+void SMF::loadFeatures( ){
+    if( featuresLoaded ) return;
+    featuresLoaded = true;
+
+    int offset;
+    char temp[256];
+    ifstream file( fileName );
 
     // Featurelist information
     file.seekg( header.featuresPtr );
@@ -160,26 +330,27 @@ bool SMF::read(){
         
     }
     else {
+        featureTypes.clear();
+        featureTypes.reserve( headerFeatures.nTypes );
         for( int i = 0; i < headerFeatures.nTypes; ++i ){
             file.getline( temp, 255, '\0' );
             featureTypes.push_back( temp );
         }
+        indexFeatureTypes();
 
-        SMF::Feature feature;
-        for( int i = 0; i < headerFeatures.nFeatures; ++i ){
-            file.read( (char *)&feature, sizeof(SMF::Feature) );
-            features.push_back( feature );
-        }
+        // the records are stored exactly as they are laid out in memory
+        features.resize( headerFeatures.nFeatures );
+        file.read( (char *)features.data(),
+                features.size() * sizeof(SMF::Feature) );
     }
-
-    file.close();
-    return false;
 }
 
 /// Output map information as string
 /**
  */
 string SMF::info(){
+    loadTiles();
+    loadFeatures();
     stringstream info;
     info << "INFO: " << fileName 
          << "\n\tVersion: " << header.version
@@ -255,54 +426,154 @@ string SMF::info(){
     return info.str();
 }
 
+/// A section of the file to be moved as raw bytes
+struct Move {
+    uint32_t from;
+    uint32_t to;
+    uint32_t bytes;
+};
+
+/// Move sections within a file without overwriting any still to be moved
+/*  Sections moving towards the start are moved first to last, then those
+ *  moving towards the end last to first. This is safe as long as the
+ *  sections stay in the same order, which updatePtrs guarantees.
+ */
+static bool
+moveSections( string fileName, vector< Move > moves )
+{
+    vector< Move > down, up;
+    for( auto i = moves.begin(); i != moves.end(); ++i ){
+        if( i->to < i->from ) down.push_back( *i );
+        else if( i->to > i->from ) up.push_back( *i );
+    }
+    if( down.empty() && up.empty() ) return false;
+
+    sort( down.begin(), down.end(),
+        []( const Move &a, const Move &b ){ return a.from < b.from; } );
+    sort( up.begin(), up.end(),
+        []( const Move &a, const Move &b ){ return a.from > b.from; } );
+    down.insert( down.end(), up.begin(), up.end() );
+
+    fstream file( fileName, ios::binary | ios::in | ios::out );
+    if(! file.good() ){
+        LOG(WARN) << "ERROR: unable to open file for writing\n";
+        return true;
+    }
+
+    const uint32_t blockSize = 1024 * 1024;
+    vector< char > block( blockSize );
+    for( auto i = down.begin(); i != down.end(); ++i ){
+        // an overlapping move has to copy away from the end it writes to
+        for( uint32_t done = 0; done < i->bytes; ){
+            uint32_t n = min( blockSize, i->bytes - done );
+            uint32_t offset = i->to < i->from ? done : i->bytes - done - n;
+            file.seekg( i->from + offset );
+            file.read( block.data(), n );
+            file.seekp( i->to + offset );
+            file.write( block.data(), n );
+            done += n;
+        }
+    }
+    file.close();
+
+    if( file.fail() ){
+        LOG(WARN) << "ERROR: failed moving sections of " << fileName;
+        return true;
+    }
+    return false;
+}
+
 /// Re-writes the data to the disk taking into consideration existing data and preserving file order
-/*
+/*  Sections that stay the same size are moved as raw bytes, only those
+ *  whose dimensions have changed are read back and re-encoded. Headers,
+ *  the tile file list and the features are written from memory.
  */
 bool SMF::reWrite( ){
-    ImageBuf *height, *type, *mini, *metal, *grass = NULL;
-    TileMap *tileMap = NULL;
-    // 0: from the very beginning full re-write
-    // 1: extra headers onwards
-    // 2: tile headers onwards
-    // 3: feature headers onwards
-    
-    // First switch gathers the data from the file that may be overwritten
-    // Second switch writes to the file from the gathered data
-
-    switch( getDirty() ){
-        case INT_MAX:
-            return false;
-        case 0:
-        case 1: 
-            height = getHeight();
-            type = getType();
-        case 2: 
-            tileMap = getMap();
-            mini = getMini();
-            metal = getMetal();
-        case 3: 
-            grass = getGrass();
+    if( getDirty() == INT_MAX ) return false;
+    // everything is written back from memory
+    loadTiles();
+    loadFeatures();
+
+    // The layout as it is on disk, before updatePtrs changes it
+    Header old = header;
+    uint32_t oldMapPtr = mapPtr;
+    uint32_t oldMapWidth = mapWidth, oldMapHeight = mapHeight;
+    ImageSpec oldHeightSpec = heightSpec;
+    ImageSpec oldTypeSpec = typeSpec;
+    ImageSpec oldMetalSpec = metalSpec;
+    ImageSpec oldGrassSpec = grassSpec;
+
+    HeaderGrass *headerGrass = NULL;
+    for( auto i = headerExtras.begin(); i != headerExtras.end(); ++i ){
+        if( (*i)->type == 1 ) headerGrass = (HeaderGrass *)*i;
     }
+    // grass always follows the features, a header that was only just
+    // added has no data behind it yet.
+    uint32_t oldGrassPtr = 0;
+    if( headerGrass && headerGrass->ptr > old.featuresPtr )
+        oldGrassPtr = headerGrass->ptr;
 
     updatePtrs();
     LOG(INFO) << "INFO: (Re-)Writing " << fileName;
 
-    writeHeaders();
-    switch( getDirty() ){
-        case 0:
-        case 1:
-            writeHeight( height );
-            writeType( type );
-        case 2:
-            writeTileHeader();
-            writeMap( tileMap );
-            writeMini( mini );
-            writeMetal( metal );
-        case 3:
-            writeFeaturesHeader();
-            writeFeatures();
-            if( grass ) writeGrass( grass );
+    // First gather the sections that need re-encoding, and the moves for
+    // the rest, then move, then write everything else.
+    ImageBuf *height = NULL, *type = NULL, *metal = NULL, *grass = NULL;
+    TileMap *tileMap = NULL;
+    vector< Move > moves;
+
+    if( oldHeightSpec.image_bytes() == heightSpec.image_bytes() )
+        moves.push_back( { (uint32_t)old.heightPtr, (uint32_t)header.heightPtr,
+                (uint32_t)heightSpec.image_bytes() } );
+    else height = getImage( old.heightPtr, oldHeightSpec );
+
+    if( oldTypeSpec.image_bytes() == typeSpec.image_bytes() )
+        moves.push_back( { (uint32_t)old.typePtr, (uint32_t)header.typePtr,
+                (uint32_t)typeSpec.image_bytes() } );
+    else type = getImage( old.typePtr, oldTypeSpec );
+
+    if( oldMapWidth == mapWidth && oldMapHeight == mapHeight )
+        moves.push_back( { oldMapPtr, mapPtr, mapBytes } );
+    else {
+        // indices laid out for another size are meaningless
+        LOG(INFO) << "INFO: tilemap size changed, clearing it";
+        tileMap = new TileMap( mapWidth, mapHeight );
+    }
+
+    moves.push_back( { (uint32_t)old.miniPtr, (uint32_t)header.miniPtr,
+            MINIMAP_SIZE } );
+
+    if( oldMetalSpec.image_bytes() == metalSpec.image_bytes() )
+        moves.push_back( { (uint32_t)old.metalPtr, (uint32_t)header.metalPtr,
+                (uint32_t)metalSpec.image_bytes() } );
+    else metal = getImage( old.metalPtr, oldMetalSpec );
+
+    if( oldGrassPtr ){
+        if( oldGrassSpec.image_bytes() == grassSpec.image_bytes() )
+            moves.push_back( { oldGrassPtr, (uint32_t)headerGrass->ptr,
+                    (uint32_t)grassSpec.image_bytes() } );
+        else grass = getImage( oldGrassPtr, oldGrassSpec );
     }
+
+    if( moveSections( fileName, moves ) ) return true;
+
+    writeHeaders();
+    writeTileHeader();
+    writeFeaturesHeader();
+    writeFeatures();
+
+    if( height ) writeHeight( height );
+    if( type ) writeType( type );
+    if( tileMap ) writeMap( tileMap );
+    if( metal ) writeMetal( metal );
+    if( grass ) writeImage( headerGrass->ptr, grassSpec, grass );
+
+    delete height;
+    delete type;
+    delete tileMap;
+    delete metal;
+    delete grass;
+
     dirty = INT_MAX;
     return false;
 }
@@ -355,12 +626,18 @@ void SMF::updateSpecs(){
  * made that will effect its values.
  */
 void SMF::updatePtrs(){
+    loadTiles();
+    loadFeatures();
     updateSpecs();
     LOG(INFO) << "INFO: Updating file offsets";
 
-    header.heightPtr = sizeof( SMF::Header );
+    // room for a grass header is always left, so that grass can be added
+    // without moving every section along to make space for it
+    header.heightPtr = headersEnd();
+    bool grass = false;
     for( auto i = headerExtras.begin(); i != headerExtras.end(); ++i )
-        header.heightPtr += (*i)->bytes;
+        grass |= (*i)->type == 1;
+    if(! grass ) header.heightPtr += sizeof( SMF::HeaderGrass );
 
     header.typePtr = header.heightPtr + heightSpec.image_bytes();
 
@@ -394,6 +671,13 @@ void SMF::updatePtrs(){
     }
 }
 
+uint32_t SMF::headersEnd( ){
+    uint32_t end = sizeof( SMF::Header );
+    for( auto i = headerExtras.begin(); i != headerExtras.end(); ++i )
+        end += (*i)->bytes;
+    return end;
+}
+
 /// Set the map x and z depth
 void SMF::setSize( int width, int length ){
     header.width = width * 64;
@@ -420,6 +704,7 @@ void SMF::setTileSize( int size ){
 /// Add Tile files
 bool SMF::addTileFile( string fileName ){
     SMT *smt = NULL;
+    loadTiles();
 
     if(! fileName.compare( "CLEAR" ) ){
         smtList.clear();
@@ -446,24 +731,22 @@ bool SMF::addTileFile( string fileName ){
     return false;
 }
 
+void SMF::indexFeatureTypes( ){
+    featureTypeIndex.clear();
+    // emplace keeps the first of any duplicate names
+    for( unsigned int i = 0; i < featureTypes.size(); ++i )
+        featureTypeIndex.emplace( featureTypes[ i ], i );
+}
+
 void SMF::addFeature( string name, float x, float y, float z, float r, float s ){
+    loadFeatures();
     SMF::Feature feature;
     feature.x = x; feature.y = y; feature.z = z;
-    feature.r = r; feature.z = s;
+    feature.r = r; feature.s = s;
 
-    bool match = false;
-    for( unsigned int i = 0; i < featureTypes.size(); ++i ){
-        if(! name.compare( featureTypes[ i ] ) ){
-            match = true;
-            feature.type = i;
-            break;
-        }
-    }
-
-    if(! match ){
-        feature.type = featureTypes.size();
-        featureTypes.push_back( name );
-    }
+    auto type = featureTypeIndex.emplace( name, featureTypes.size() );
+    if( type.second ) featureTypes.push_back( name );
+    feature.type = type.first->second;
 
     features.push_back( feature );
 
@@ -475,24 +758,96 @@ void SMF::addFeature( string name, float x, float y, float z, float r, float s )
 /*! replaces features in smf with those specified in the fileName.csv
  */
 void SMF::addFeatures( string fileName ){
+    if( readFeatures( fileName ) ) return;
+    setDirty(3);
+    reWrite();
+}
+
+/// parse a decimal float filling [p, end), false if it is not one
+/*  Spaces either side are ignored. Up to 18 significant digits are kept,
+ *  far more than a float can hold.
+ */
+static bool
+parseFloat( const char *p, const char *end, float &value )
+{
+    while( p < end && (*p == ' ' || *p == '\t') ) ++p;
+    while( end > p && (end[ -1 ] == ' ' || end[ -1 ] == '\t') ) --end;
+
+    bool negative = p < end && *p == '-';
+    if( p < end && (*p == '-' || *p == '+') ) ++p;
+
+    uint64_t mantissa = 0;
+    int exponent = 0, digits = 0;
+    for( ; p < end && (unsigned char)(*p - '0') < 10; ++p, ++digits ){
+        if( mantissa < 100000000000000000ull ) mantissa = mantissa * 10 + (*p - '0');
+        else ++exponent;
+    }
+    if( p < end && *p == '.' ){
+        for( ++p; p < end && (unsigned char)(*p - '0') < 10; ++p, ++digits ){
+            if( mantissa >= 100000000000000000ull ) continue;
+            mantissa = mantissa * 10 + (*p - '0');
+            --exponent;
+        }
+    }
+    if(! digits ) return false;
+
+    if( p < end && (*p == 'e' || *p == 'E') ){
+        ++p;
+        bool negativeExponent = p < end && *p == '-';
+        if( p < end && (*p == '-' || *p == '+') ) ++p;
+        int e = 0;
+        const char *first = p;
+        for( ; p < end && (unsigned char)(*p - '0') < 10; ++p ){
+            if( e < 1000 ) e = e * 10 + (*p - '0');
+        }
+        if( p == first ) return false;
+        exponent += negativeExponent ? -e : e;
+    }
+    if( p != end ) return false;
+
+    // powers of ten up to 1e22 are exact in a double
+    static const double powers[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6,
+        1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17,
+        1e18, 1e19, 1e20, 1e21, 1e22 };
+    double v = mantissa;
+    if( exponent < 0 ){
+        v = -exponent <= 22 ? v / powers[ -exponent ] : v * pow( 10.0, exponent );
+    }
+    else if( exponent > 0 ){
+        v = exponent <= 22 ? v * powers[ exponent ] : v * pow( 10.0, exponent );
+    }
+    value = negative ? -v : v;
+    return true;
+}
+
+/// replaces the feature lists in memory with those from fileName.csv
+/*  Lines are NAME,X,Y,Z,R,S. The file is mapped and parsed in a single
+ *  pass, bad lines are skipped and only the first few reported.
+ */
+bool SMF::readFeatures( string fileName ){
+    // whatever is on disk is replaced, so there is no need to load it
+    featuresLoaded = true;
+
+    //Clear out the old list
+    if(! fileName.compare("CLEAR") ){
+        features.clear();
+        featureTypes.clear();
+        featureTypeIndex.clear();
+        headerFeatures.nTypes = 0;
+        headerFeatures.nFeatures = 0;
+        return false;
+    }
 
     // test the file
-    fstream file( fileName, ifstream::in );
+    MappedFile file( fileName );
     if(! file.good() ){
         LOG(WARN) << "ERROR.addFeatures: Cannot open " << fileName;
-        return;
+        return true;
     }
 
-    //Clear out the old list
     features.clear();
     featureTypes.clear();
 
-    if(! fileName.compare("CLEAR") ){
-        setDirty(3);
-        reWrite();
-        return;
-    }
-
     // build inbuilt list
     char featureType[256];
     for( int i = 0; i < 16; ++i ){
@@ -500,43 +855,57 @@ void SMF::addFeatures( string fileName ){
         featureTypes.push_back( featureType );
     }
     featureTypes.push_back("GeoVent");
+    indexFeatureTypes();
 
-    int n = 0;
-    string cell;
-    stringstream line;
-    vector<string> tokens;
-    while( getline( file, cell ) ){
+    const char *p = file.data();
+    const char *end = p + file.size();
+    uint32_t n = 0, errors = 0;
+    while( p < end ){
         ++n;
-        line.str( cell );
-
-        tokens.clear();
-        while( getline( line, cell, ',' ) ) tokens.push_back( cell );
-        if( tokens.size() != 6 ) continue;
-       
-        try{
-            addFeature(
-                tokens[ 0 ],           //name
-                stof( tokens[ 1 ] ),   //x
-                stof( tokens[ 2 ] ),   //y
-                stof( tokens[ 3 ] ),   //z
-                stof( tokens[ 4 ] ),   //r
-                stof( tokens[ 5 ] ) ); //s
+        const char *lineEnd = (const char *)memchr( p, '\n', end - p );
+        if(! lineEnd ) lineEnd = end;
+        const char *next = lineEnd < end ? lineEnd + 1 : end;
+        if( lineEnd > p && lineEnd[ -1 ] == '\r' ) --lineEnd;
+
+        // split on commas, a seventh field means there are too many
+        const char *fields[ 7 ];
+        int nFields = 0;
+        for( const char *f = p; nFields < 7; ++nFields ){
+            fields[ nFields ] = f;
+            const char *comma = (const char *)memchr( f, ',', lineEnd - f );
+            if(! comma ){ ++nFields; break; }
+            f = comma + 1;
         }
-        catch ( std::invalid_argument ){
-            LOG(WARN) << "WARN.addFeatures: " << fileName << ", skipping invalid line at "
-                << n;
-            continue;
+
+        float v[ 5 ];
+        bool good = nFields == 6;
+        for( int i = 0; good && i < 5; ++i ){
+            const char *fieldEnd = i < 4 ? fields[ i + 2 ] - 1 : lineEnd;
+            good = parseFloat( fields[ i + 1 ], fieldEnd, v[ i ] );
         }
 
+        if( good ){
+            // one line in the file is usually much like the next
+            if( features.empty() )
+                features.reserve( file.size() / (next - p) + 1 );
+            addFeature( string( fields[ 0 ], fields[ 1 ] - 1 ),
+                    v[ 0 ], v[ 1 ], v[ 2 ], v[ 3 ], v[ 4 ] );
+        }
+        // blank lines and the column names written by getFeatures are fine
+        else if( lineEnd != p && !(n == 1 && ! strncmp( p, "NAME,", 5 )) ){
+            if( errors++ < 10 ) LOG(WARN) << "WARN.addFeatures: "
+                << fileName << ", skipping invalid line at " << n;
+        }
+        p = next;
     }
-    file.close();
+    if( errors > 10 ) LOG(WARN) << "WARN.addFeatures: " << fileName << ", "
+        << errors - 10 << " more invalid lines not shown";
 
     LOG(INFO) 
         << "INFO.addFeatures"
         << "\n\tTypes: " << headerFeatures.nTypes
-        << "\n\tTypes: " << headerFeatures.nFeatures;
-    setDirty(3);
-    reWrite();
+        << "\n\tFeatures: " << headerFeatures.nFeatures;
+    return false;
 }
 
 bool SMF::writeHeaders(){
@@ -559,73 +928,128 @@ bool SMF::writeHeaders(){
     return false;
 }
 
-bool SMF::writeImage( unsigned int ptr, ImageSpec spec, ImageBuf *sourceBuf ){
-    if( sourceBuf ) sourceBuf->read( 0, 0, true, spec.format );
-    ImageBuf *imageBufa = channels( sourceBuf, spec );
-    ImageBuf *imageBufb = scale( imageBufa, spec );
-    delete imageBufa;
+ImageBuf *SMF::prepareImage( ImageSpec spec, ImageBuf *sourceBuf,
+        ResampleFilter filter ){
+    return convert( sourceBuf, spec, filter );
+}
 
-    // write the data to the smf
+bool SMF::writeData( uint32_t ptr, const char *data, uint32_t bytes ){
     fstream file( fileName, ios::binary | ios::in | ios::out );
+    if(! file.good() ){
+        LOG(WARN) << "ERROR: unable to open file for writing\n";
+        return true;
+    }
     file.seekp( ptr );
-    file.write( (char *)imageBufb->localpixels(), spec.image_bytes() );
+    file.write( data, bytes );
     file.close();
+    return file.fail();
+}
 
-    delete imageBufb;
-    return false;
+bool SMF::writeImage( unsigned int ptr, ImageSpec spec, ImageBuf *sourceBuf,
+        ResampleFilter filter ){
+    ImageBuf *imageBuf = prepareImage( spec, sourceBuf, filter );
+
+    // write the data to the smf
+    bool fail = writeData( ptr, (char *)imageBuf->localpixels(),
+            spec.image_bytes() );
+
+    delete imageBuf;
+    return fail;
+}
+
+ImageBuf *SMF::prepareHeight( ImageBuf *sourceBuf, ThreadPool &pool ){
+    if(! sourceBuf ) return prepareImage( heightSpec, sourceBuf );
+
+    sourceBuf->read( 0, 0, true );
+    const ImageSpec &sourceSpec = sourceBuf->spec();
+    if( sourceSpec.format == TypeDesc::UINT8
+            || sourceSpec.format == TypeDesc::UINT16 ){
+        if( autoDepth ) LOG(WARN) << "WARNING: integer heightmaps carry no "
+            "depth, leaving floor and ceiling as they are";
+        return prepareImage( heightSpec, sourceBuf );
+    }
+
+    // the first channel as floats, straight from the buffer when it can be
+    int sw = sourceSpec.width, sh = sourceSpec.height;
+    vector< float > heights;
+    const float *in = (const float *)sourceBuf->localpixels();
+    if(! in || sourceSpec.format != TypeDesc::FLOAT
+            || sourceSpec.nchannels != 1 ){
+        heights.resize( (size_t)sw * sh );
+        ROI roi = sourceBuf->roi();
+        roi.chbegin = 0;
+        roi.chend = 1;
+        sourceBuf->get_pixels( roi, TypeDesc::FLOAT, heights.data() );
+        in = heights.data();
+    }
+
+    float floor = 0.0f, ceiling = 1.0f;
+    if( autoDepth ){
+        if( HeightMap::range( in, (size_t)sw * sh, floor, ceiling, pool ) ){
+            header.floor = floor;
+            header.ceiling = ceiling;
+            LOG(INFO) << "INFO: Depth set from heightmap, floor: " << floor
+                << " ceiling: " << ceiling;
+        }
+        else {
+            LOG(WARN) << "WARNING: heightmap has no heights, leaving floor "
+                "and ceiling as they are";
+            floor = 0.0f;
+            ceiling = 1.0f;
+        }
+    }
+
+    if( sw != heightSpec.width || sh != heightSpec.height ){
+        vector< float > scaled( heightSpec.image_pixels() );
+        HeightMap::resample( in, sw, sh, scaled.data(),
+                heightSpec.width, heightSpec.height, pool );
+        heights.swap( scaled );
+        in = heights.data();
+    }
+
+    ImageBuf *imageBuf = new ImageBuf( heightSpec );
+    HeightMap::quantize( in, heightSpec.image_pixels(), floor, ceiling,
+            (uint16_t *)imageBuf->localpixels(), pool );
+    return imageBuf;
 }
 
 bool SMF::writeHeight( ImageBuf *sourceBuf ){
     LOG(INFO) << "INFO: Writing height\n";
-    return writeImage( header.heightPtr, heightSpec, sourceBuf );   
+    ThreadPool pool;
+    float floor = header.floor, ceiling = header.ceiling;
+    ImageBuf *imageBuf = prepareHeight( sourceBuf, pool );
+    bool fail = writeData( header.heightPtr, (char *)imageBuf->localpixels(),
+            heightSpec.image_bytes() );
+    delete imageBuf;
+
+    if( floor != header.floor || ceiling != header.ceiling )
+        fail |= writeHeaders();
+    return fail;
 }
 
 bool SMF::writeType( ImageBuf *sourceBuf ){
     LOG(INFO) << "INFO: Writing type\n";
-    return writeImage( header.typePtr, typeSpec, sourceBuf );   
+    return writeImage( header.typePtr, typeSpec, sourceBuf, typeFilter );
 }
 
 bool SMF::writeMini( ImageBuf * sourceBuf ){
     LOG(INFO) << "INFO: Writing mini\n";
-    ImageBuf *tempBufa = channels( sourceBuf, miniSpec );    
-    ImageBuf *miniBuf = scale( tempBufa, miniSpec );  
-    delete tempBufa; 
-
-    ImageSpec spec;
-    int blocks_size = 0;
-    squish::u8 *blocks = NULL;
-    fstream file( fileName, ios::binary | ios::in | ios::out );
-    file.seekp( header.miniPtr );
-    for( int i = 0; i < 9; ++i ){
-        spec = miniBuf->specmod();
-
-        blocks_size = squish::GetStorageRequirements(
-                spec.width, spec.height, squish::kDxt1 );
-
-        if(! blocks ) blocks = new squish::u8[ blocks_size ];
-
-        squish::CompressImage( (squish::u8 *)miniBuf->localpixels(),
-                spec.width, spec.height, blocks, squish::kDxt1 );
-
-        // Write data to smf
-        file.write( (char*)blocks, blocks_size );
+    ThreadPool pool;
+    vector< char > blocks( MINIMAP_SIZE );
+    compressMini( sourceBuf, blocks.data(), pool );
+    return writeData( header.miniPtr, blocks.data(), MINIMAP_SIZE );
+}
 
-        spec.width = spec.width >> 1;
-        spec.height = spec.height >> 1;
-        tempBufa = miniBuf;
-        miniBuf = scale( tempBufa, spec );
-        delete tempBufa;
-    }
-    file.close();
+void SMF::compressMini( ImageBuf *sourceBuf, char *blocks, ThreadPool &pool ){
+    ImageBuf *miniBuf = prepareImage( miniSpec, sourceBuf );
+    MiniMap::compress( (uint8_t *)miniBuf->localpixels(), blocks, pool );
     delete miniBuf;
-    delete blocks;
-
-    return false;
 }
 
 /// Write the tile header information to the smf
 bool SMF::writeTileHeader(){
     LOG(INFO) << "INFO: Writing tile reference information\n";
+    loadTiles();
     fstream file( fileName, ios::binary | ios::in | ios::out );
     file.seekp( header.tilesPtr );
 
@@ -646,7 +1070,13 @@ bool SMF::writeTileHeader(){
 // write the tilemap information to the smf
 bool SMF::writeMap( TileMap *tileMap ){
     if(! tileMap ) return true;
+    if( tileMap->width != mapWidth || tileMap->height != mapHeight ){
+        LOG(WARN) << "ERROR: tilemap is " << tileMap->width << "x"
+            << tileMap->height << ", expected " << mapWidth << "x" << mapHeight;
+        return true;
+    }
     LOG(INFO) << "INFO: Writing map\n";
+    loadTiles();
     std::fstream file(fileName,
             std::ios::binary | std::ios::in | std::ios::out);
     file.seekp( mapPtr );
@@ -658,23 +1088,33 @@ bool SMF::writeMap( TileMap *tileMap ){
 /// write the metal image to the smf
 bool SMF::writeMetal( ImageBuf *sourceBuf ){
     LOG(INFO) << "INFO: Writing metal\n";
-    return writeImage( header.metalPtr, metalSpec, sourceBuf );   
+    return writeImage( header.metalPtr, metalSpec, sourceBuf, metalFilter );
+}
+
+/// the null terminated names as they are stored, so they go in one write
+static string
+featureNames( const vector< string > &types )
+{
+    string names;
+    for( auto i = types.begin(); i != types.end(); ++i )
+        names.append( i->c_str(), i->size() + 1 );
+    return names;
 }
 
 /// write the feature header information to the smf
 bool SMF::writeFeaturesHeader() {
     LOG(INFO) << "INFO: Writing feature headers\n";
+    loadFeatures();
     fstream file( fileName, ios::binary | ios::in | ios::out );
     file.seekp( header.featuresPtr );
 
-    // Tiles Header
+    // Features Header
     headerFeatures.nTypes = featureTypes.size();
     headerFeatures.nFeatures = features.size();
     file.write( (char *)&headerFeatures, sizeof( SMF::HeaderFeatures ) );
-    // SMT Names
-    for( auto i = featureTypes.begin(); i != featureTypes.end(); ++i ){
-        file.write( (*i).c_str(), (*i).size() + 1 );
-    }
+    // Feature Names
+    string names = featureNames( featureTypes );
+    file.write( names.data(), names.size() );
     file.close();
 
     return false;
@@ -682,17 +1122,14 @@ bool SMF::writeFeaturesHeader() {
 
 bool SMF::writeFeatures(){
     LOG(INFO) << "INFO: Writing features\n";
+    loadFeatures();
 
     fstream file( fileName, ios::binary | ios::in | ios::out );
     file.seekp( header.featuresPtr + 8 );
 
-    for( auto i = featureTypes.begin(); i != featureTypes.end(); ++i ){
-        file.write( i->c_str(), i->size() + 1 );
-    }
-
-    for( auto i = features.begin(); i != features.end(); ++i ){
-        file.write( (char *)&(*i), sizeof(Feature) );
-    }
+    string names = featureNames( featureTypes );
+    file.write( names.data(), names.size() );
+    file.write( (char *)features.data(), features.size() * sizeof(Feature) );
 
   //  file.write( '\0', 1 );
     file.close();
@@ -700,49 +1137,73 @@ bool SMF::writeFeatures(){
 }
 
 
+static uint64_t
+fileSize( string fileName )
+{
+    ifstream file( fileName, ios::binary | ios::ate );
+    return file.good() ? (uint64_t)file.tellg() : 0;
+}
+
 /// Write the grass image to the smf
-/*
+/*  Grass is the last section, and room for its header is kept in front of
+ *  the height map, so adding grass only writes the headers and appends
+ *  the data, removing it truncates the file. Maps written without the
+ *  room are rewritten once to make it, the sections moving as raw bytes.
  */
 bool SMF::writeGrass( ImageBuf *sourceBuf ) {
-    HeaderGrass *headerGrass = NULL;
-    bool rewrite = false;
-
-    // get header if it exists.
+    auto grassHeader = headerExtras.end();
     for( auto i = headerExtras.begin(); i != headerExtras.end(); ++i ){
-        if( (*i)->type == 1) headerGrass = (HeaderGrass *)*i;
+        if( (*i)->type == 1 ) grassHeader = i;
     }
 
-    if(! sourceBuf && headerGrass ){
-        for( auto i = headerExtras.begin(); i != headerExtras.end(); ++i ){
-            if( (*i)->type == 1 ){
-                i = headerExtras.erase(i);
-                --i;
-                --header.nHeaderExtras;
-            }
+    if(! sourceBuf ){
+        if( grassHeader == headerExtras.end() ) return false;
+        LOG(INFO) << "INFO: Removing grass\n";
+
+        HeaderGrass *headerGrass = (HeaderGrass *)*grassHeader;
+        uint32_t grassPtr = headerGrass->ptr;
+        headerExtras.erase( grassHeader );
+        delete headerGrass;
+        --header.nHeaderExtras;
+
+        // the header's old place is left blank, ready for the next one
+        vector< char > blank( sizeof( SMF::HeaderGrass ) );
+        if( writeHeaders() ) return true;
+        if( writeData( headersEnd(), blank.data(), blank.size() ) ) return true;
+
+        // data anywhere but the end is dropped by the next reWrite
+        if( grassPtr > (uint32_t)header.featuresPtr
+                && grassPtr + (uint64_t)grassSpec.image_bytes()
+                    >= fileSize( fileName )
+                && truncate( fileName.c_str(), grassPtr ) ){
+            LOG(WARN) << "WARNING: unable to truncate " << fileName;
         }
-        setDirty( 0 );
-        reWrite();
         return false;
     }
-    else if(! sourceBuf && ! headerGrass ) return false;
 
-    LOG(INFO) << "INFO: Writing Grass\n";
-
-    // else create one.
-    if(! headerGrass ){
-        rewrite = true;
+    HeaderGrass *headerGrass = NULL;
+    if( grassHeader != headerExtras.end() ){
+        headerGrass = (HeaderGrass *)*grassHeader;
+    }
+    else {
         headerGrass = new HeaderGrass();
+        bool room = header.heightPtr
+            >= (int)(headersEnd() + sizeof( SMF::HeaderGrass ));
         headerExtras.push_back( headerGrass );
         ++header.nHeaderExtras;
-    }
 
-    if(! rewrite )
-        return writeImage( headerGrass->ptr, grassSpec, sourceBuf );
-    else
-        setDirty( 0 );
-        reWrite();   
+        if( room ){
+            headerGrass->ptr = fileSize( fileName );
+            if( writeHeaders() ) return true;
+        }
+        else {
+            setDirty( 0 );
+            reWrite();
+        }
+    }
 
-    return false;
+    LOG(INFO) << "INFO: Writing Grass\n";
+    return writeImage( headerGrass->ptr, grassSpec, sourceBuf );
 }
 
 
@@ -759,6 +1220,49 @@ ImageBuf *SMF::getImage( unsigned int ptr, ImageSpec spec){
     return imageBuf;
 }
 
+/// map the file and point a view at the section at ptr
+static SMF::View getView( string fileName, uint32_t ptr, ImageSpec spec ){
+    SMF::View view;
+    view.spec = spec;
+    view.file = std::make_shared< MappedFile >( fileName );
+    if(! view.file->good() ) return view;
+
+    if( ptr + (size_t)spec.image_bytes() > view.file->size() ){
+        LOG(WARN) << "ERROR: " << fileName << " is too short to hold a "
+            << spec.width << "x" << spec.height << " section at "
+            << int_to_hex( ptr );
+        return view;
+    }
+    view.data = view.file->data() + ptr;
+    return view;
+}
+
+SMF::View SMF::viewHeight( ){ return getView( fileName, header.heightPtr, heightSpec ); }
+
+SMF::View SMF::viewType( ){ return getView( fileName, header.typePtr, typeSpec ); }
+
+SMF::View SMF::viewMap( ){
+    loadTiles();
+    ImageSpec spec( mapWidth, mapHeight, 1, TypeDesc::UINT32 );
+    return getView( fileName, mapPtr, spec );
+}
+
+SMF::View SMF::viewMini( ){
+    // not an image as such, just the bytes of the blocks
+    ImageSpec spec( MINIMAP_SIZE, 1, 1, TypeDesc::UINT8 );
+    return getView( fileName, header.miniPtr, spec );
+}
+
+SMF::View SMF::viewMetal( ){ return getView( fileName, header.metalPtr, metalSpec ); }
+
+SMF::View SMF::viewGrass( ){
+    for( auto i = headerExtras.begin(); i != headerExtras.end(); ++i ){
+        if( (*i)->type == 1 )
+            return getView( fileName, ((HeaderGrass *)(*i))->ptr, grassSpec );
+    }
+    return View();
+}
+
 ImageBuf *SMF::getHeight( ){ return getImage( header.heightPtr, heightSpec ); }
 
 ImageBuf *SMF::getType( ){ return getImage( header.typePtr, typeSpec ); }
@@ -766,39 +1270,61 @@ ImageBuf *SMF::getType( ){ return getImage( header.typePtr, typeSpec ); }
 TileMap *
 SMF::getMap( )
 {
-    TileMap *tileMap = new TileMap( mapWidth, mapHeight );
+    loadTiles();
     std::fstream file( fileName, std::ios::binary | std::ios::in );
+    if(! file.good() ) return NULL;
+
+    TileMap *tileMap = new TileMap( mapWidth, mapHeight );
+    uint32_t *indices = tileMap->data();
+    uint32_t nCells = mapWidth * mapHeight;
+
+    // the whole map in a single read
     file.seekg( mapPtr );
-    for( unsigned int y = 0; y < mapHeight; ++y )
-    for( unsigned int x = 0; x < mapWidth; ++x ){
-        file.read( (char *)&(*tileMap)( x, y ), 4 );
+    file.read( (char *)indices, nCells * 4 );
+    file.close();
+
+    // count first, branch free so that it vectorises, and only go looking
+    // for the bad cells when there are some.
+    uint32_t nTiles = headerTiles.nTiles;
+    uint32_t nBad = 0;
+    for( uint32_t i = 0; i < nCells; ++i ) nBad += indices[ i ] >= nTiles;
+
+    if( nBad ){
+        LOG(WARN) << fileName << ": " << nBad << " of " << nCells
+            << " tilemap cells reference tiles beyond the " << nTiles
+            << " available";
+        for( uint32_t i = 0, shown = 0; i < nCells && shown < 10; ++i ){
+            if( indices[ i ] < nTiles ) continue;
+            LOG(WARN) << "\tcell " << i % mapWidth << "," << i / mapWidth
+                << " = " << indices[ i ];
+            ++shown;
+        }
     }
 
     return tileMap;
 }
 
 ImageBuf *SMF::getMini(){
-    ImageBuf * imageBuf = NULL;
-    unsigned char data[1024 * 1024 * 4];
-
-    ifstream smf( fileName );
-    if( smf.good() ) {
-        unsigned char *temp = new unsigned char[MINIMAP_SIZE];
-        smf.seekg( header.miniPtr );
-        smf.read( (char *)temp, MINIMAP_SIZE);
+    ifstream smf( fileName, ios::binary );
+    if(! smf.good() ) return NULL;
 
-        squish::DecompressImage( (squish::u8 *)data, 1024, 1024, temp, squish::kDxt1);
-
-        delete [] temp;
-        imageBuf = new ImageBuf( miniSpec, data );
-    }
+    vector< char > blocks( MINIMAP_SIZE );
+    smf.seekg( header.miniPtr );
+    smf.read( blocks.data(), MINIMAP_SIZE );
     smf.close();
+
+    // decoded straight into the image, which owns its pixels
+    ImageBuf *imageBuf = new ImageBuf( miniSpec );
+    ThreadPool pool;
+    MiniMap::decompress( blocks.data(), (uint8_t *)imageBuf->localpixels(),
+            pool );
     return imageBuf;
 }
 
 ImageBuf *SMF::getMetal( ){ return getImage( header.metalPtr, metalSpec ); }
 
 string SMF::getFeatureTypes( ){
+    loadFeatures();
     stringstream list;
     for( auto i = featureTypes.begin(); i != featureTypes.end(); ++i ){
         list << *i;
@@ -809,6 +1335,7 @@ string SMF::getFeatureTypes( ){
 /*! Gets the features list in csv formatted string
  */
 string SMF::getFeatures( ){
+    loadFeatures();
     stringstream list;
     list << "NAME,X,Y,Z,ANGLE,SCALE\n";
     for( auto i = features.begin(); i != features.end(); ++i ){
@@ -817,7 +1344,7 @@ string SMF::getFeatures( ){
              << i->y << ","
              << i->z << ","
              << i->r << ","
-             << i->s;
+             << i->s << "\n";
     }
 
     return list.str();
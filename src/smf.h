@@ -1,11 +1,16 @@
 #ifndef __SMF_H
 #define __SMF_H
 #include "tilemap.h"
+#include "threadpool.h"
+#include "mappedfile.h"
+#include "util.h"
 
 #include <cstring>
 #include <climits>
 #include <cstdint>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include <OpenImageIO/imagebuf.h>
@@ -145,20 +150,121 @@ class SMF {
 
     HeaderFeatures headerFeatures;
     std::vector< std::string > featureTypes; ///< names of features
+    std::unordered_map< std::string, int > featureTypeIndex; ///< name to type
     std::vector< SMF::Feature > features;
 
     OpenImageIO::ImageSpec grassSpec;
 
+    // how the categorical layers are resampled when their size is off
+    ResampleFilter typeFilter = MAJORITY;
+    ResampleFilter metalFilter = NEAREST;
+    bool autoDepth = false; //< take floor and ceiling from float heightmaps
+
+    // sections that read() leaves on disk until they are first needed
+    bool tilesLoaded = true;
+    bool featuresLoaded = true;
+
     void updatePtrs( );
     void updateSpecs( );
+    void loadTiles( );    //< the tile file list and with it mapPtr
+    void loadFeatures( ); //< feature types and records
+    uint32_t headersEnd( ); //< end of the header and the extra headers
+    bool readFeatures( std::string fileName );
+    void indexFeatureTypes( ); //< rebuild featureTypeIndex from featureTypes
     void setDirty( int i );
     int getDirty();
 
     OpenImageIO::ImageBuf *getImage( uint32_t ptr, OpenImageIO::ImageSpec spec );
     bool writeImage( uint32_t ptr, OpenImageIO::ImageSpec spec,
-            OpenImageIO::ImageBuf *sourceBuf = NULL );
+            OpenImageIO::ImageBuf *sourceBuf = NULL,
+            ResampleFilter filter = NEAREST );
+    bool writeData( uint32_t ptr, const char *data, uint32_t bytes );
+
+    /// convert and scale an image to spec, ready to be written
+    OpenImageIO::ImageBuf *prepareImage( OpenImageIO::ImageSpec spec,
+            OpenImageIO::ImageBuf *sourceBuf, ResampleFilter filter = NEAREST );
+    /// convert the heightmap to heightSpec
+    /*  Floating point heights are resampled bilinearly and quantized on
+     *  the pool, as 0 to 1 or, with autoDepth, from their lowest to
+     *  highest which then become the floor and ceiling.
+     */
+    OpenImageIO::ImageBuf *prepareHeight( OpenImageIO::ImageBuf *sourceBuf,
+            ThreadPool &pool );
+    /// compress the minimap and its mip levels into MINIMAP_SIZE bytes
+    void compressMini( OpenImageIO::ImageBuf *sourceBuf, char *blocks,
+            ThreadPool &pool );
 
 public:
+    /// Read only view of a section of the file, straight from a mapping
+    /** Nothing is copied, the view keeps the file mapped for as long as it
+     *  or a copy of it lives. Writing to the smf afterwards leaves the
+     *  contents of existing views undefined. data points at the section's
+     *  offset in the file and so is not necessarily aligned, read wider
+     *  values from it with memcpy.
+     */
+    struct View {
+        std::shared_ptr< MappedFile > file; //< keeps the mapping alive
+        const void *data = NULL;
+        OpenImageIO::ImageSpec spec;
+
+        bool good( ){ return data; };
+        /// wrap the view in an ImageBuf, which must not outlive the view
+        OpenImageIO::ImageBuf *imageBuf( ){
+            return new OpenImageIO::ImageBuf( spec, const_cast< void * >( data ) );
+        };
+    };
+
+    /// Collects everything that makes up a new map, then writes it once
+    /** Unlike SMF::create followed by the write functions, nothing touches
+     *  the disk until write(), which works out the layout once and writes
+     *  each section a single time, in file order. Layers that are not set
+     *  are left blank. The images and tilemap passed in are not owned and
+     *  must stay valid until write() is called.
+     */
+    class Builder {
+        SMF *smf;
+        OpenImageIO::ImageBuf *height = NULL;
+        OpenImageIO::ImageBuf *type = NULL;
+        TileMap *tileMap = NULL;
+        OpenImageIO::ImageBuf *mini = NULL;
+        OpenImageIO::ImageBuf *metal = NULL;
+        OpenImageIO::ImageBuf *grass = NULL;
+        std::string featuresFile;
+
+    public:
+        Builder( std::string fileName );
+        ~Builder( );
+
+        Builder( const Builder & ) = delete;
+        Builder &operator=( const Builder & ) = delete;
+
+        // specification
+        void setSize( int width, int length );
+        void setDepth( float floor, float ceiling );
+        void setTileSize( int size );
+        bool addTileFile( std::string fileName );
+        void addFeatures( std::string fileName ){ featuresFile = fileName; };
+        void setTypeFilter( ResampleFilter f ){ smf->typeFilter = f; };
+        void setMetalFilter( ResampleFilter f ){ smf->metalFilter = f; };
+        void setAutoDepth( bool fit ){ smf->autoDepth = fit; };
+
+        // layers
+        void setHeight( OpenImageIO::ImageBuf *buf ){ height = buf; };
+        void setType( OpenImageIO::ImageBuf *buf ){ type = buf; };
+        void setMap( TileMap *map ){ tileMap = map; };
+        void setMini( OpenImageIO::ImageBuf *buf ){ mini = buf; };
+        void setMetal( OpenImageIO::ImageBuf *buf ){ metal = buf; };
+        void setGrass( OpenImageIO::ImageBuf *buf ){ grass = buf; };
+
+        /// write the map to disk, returns NULL on failure
+        /*  The layers are converted, the minimap compressed and the
+         *  features parsed all at the same time on a pool of threads,
+         *  then written out in order. The returned SMF is owned by the
+         *  caller, the builder can not be written again afterwards.
+         */
+        SMF *write( bool overwrite = false );
+    };
+
     SMF( ){ };
     SMF( std::string f ): fileName( f )
     { };
@@ -173,7 +279,23 @@ public:
 
     void setSize( int width, int length );
     void setDepth( float floor, float ceiling );
+    float getFloor( ){ return header.floor; };
+    float getCeiling( ){ return header.ceiling; };
     void setTileSize( int size );
+
+    /// filters used to fit the type and metal maps to the map size
+    /*  Types default to a majority vote so that downscaling never makes up
+     *  type ids, metal to the nearest pixel. Takes effect on the next
+     *  writeType(), writeMetal() or reWrite().
+     */
+    void setTypeFilter( ResampleFilter filter ){ typeFilter = filter; };
+    void setMetalFilter( ResampleFilter filter ){ metalFilter = filter; };
+
+    /// set floor and ceiling from the heights of the next float heightmap
+    /*  The heights are then stored at full precision between the two,
+     *  instead of floats being taken as 0 to 1.
+     */
+    void setAutoDepth( bool fit ){ autoDepth = fit; };
     
     bool addTileFile( std::string fileName );
     void addFeature( std::string name,
@@ -196,7 +318,8 @@ public:
 
     OpenImageIO::ImageBuf *getHeight();
     OpenImageIO::ImageBuf *getType();
-    std::vector< std::string> getTileFileNames(){ return smtList; };
+    std::vector< std::string> getTileFileNames(){ loadTiles(); return smtList; };
+    std::vector< uint32_t > getTileFileNTiles(){ loadTiles(); return nTiles; };
     TileMap *getMap();
     OpenImageIO::ImageBuf *getMini();
     OpenImageIO::ImageBuf *getMetal();
@@ -204,5 +327,13 @@ public:
     std::string getFeatures();
     OpenImageIO::ImageBuf *getGrass();
 
+    // zero copy access to the raw sections, see View
+    View viewHeight( );
+    View viewType( );
+    View viewMap( ); //< mapWidth x mapHeight:1 UINT32 tile indices
+    View viewMini( ); //< MINIMAP_SIZE bytes of DXT1 blocks
+    View viewMetal( );
+    View viewGrass( );
+
 };
 #endif //__SMF_H
@@ -63,6 +63,7 @@ enum optionsIndex
     TILESIZE,
     // Source materials
     HEIGHT, TYPE, MAP, MINI, METAL, FEATURES, GRASS,
+    TYPE_FILTER, METAL_FILTER, AUTO_DEPTH,
     // Compression
     DXT1_QUALITY, 
 };
@@ -84,7 +85,7 @@ const option::Descriptor usage[] = {
         "\nFILE OPS:" },
     { IFILE, 0, "f", "file", Arg::Required,
         "  -f,  \t--file=mymap.smf  \tFile to operate on, will create if it doesnt exist" },
-    { OVERWRITE, 0, "", "overwrite", Arg::Required,
+    { OVERWRITE, 0, "", "overwrite", Arg::None,
         "\t--overwrite  \tOverwrite existing files" },
 
     { UNKNOWN, 0, "", "", Arg::None,
@@ -95,6 +96,8 @@ const option::Descriptor usage[] = {
         "  -y,  \t--floor=1.0f  \tMinimum height of the map." },
     { CEILING, 0, "Y", "ceiling", Arg::Numeric,
         "  -Y,  \t--ceiling=1.0f  \tMaximum height of the map." },
+    { AUTO_DEPTH, 0, "", "auto-depth", Arg::None,
+        "\t--auto-depth  \tTake the floor and ceiling from the lowest and highest points of a floating point heightmap." },
     { TILESIZE, 0, "", "tilesize", Arg::Numeric,
         "\t--tilesize=X  \tXY resolution of tiles referenced, eg. '--tileres=32'." },
 
@@ -105,7 +108,7 @@ const option::Descriptor usage[] = {
     { TYPE, 0, "", "type", Arg::Required,
         "\t--type=type.tif  \t(x*32)x(y*32):1 UINT8 Image to use for typemap." },
     { MAP, 0, "", "map", Arg::Required,
-        "\t--map=map.tif  \t(x*16)x(y*16):1 UINT32 Image to use for tilemap." },
+        "\t--map=map.csv  \t(x*16)x(y*16) csv or binary tilemap, or an smf to copy it from." },
     { MINI, 0, "", "mini", Arg::Required,
         "\t--mini=mini.tif  \t(1024)x(1024):4 UINT8 Image to use for minimap." },
     { METAL, 0, "", "metal", Arg::Required,
@@ -114,6 +117,10 @@ const option::Descriptor usage[] = {
         "\t--features=list.csv  \tList of features with format:\n\t\tNAME,X,Y,Z,R,S"},
     { GRASS, 0, "", "grass", Arg::Required,
         "\t--grass=grass.tif  \t(x*16)x(y*16):1 UINT8 Image to use for grassmap." },
+    { TYPE_FILTER, 0, "", "type-filter", Arg::Required,
+        "\t--type-filter=majority  \tHow the typemap is fit to the map size, 'nearest' or 'majority' of the pixels covered." },
+    { METAL_FILTER, 0, "", "metal-filter", Arg::Required,
+        "\t--metal-filter=nearest  \tHow the metalmap is fit to the map size, 'nearest' or 'majority'." },
 
     { UNKNOWN, 0, "", "", Arg::None,
         "\nCOMPRESSION:" },
@@ -159,122 +166,156 @@ main( int argc, char **argv )
     bool overwrite = false;
 
     unsigned int mx = 2, my = 2;
+    float floor = 10.0f, ceiling = 256.0f;
+    if( options[ FLOOR ] ) floor = stof( options[ FLOOR ].arg );
+    if( options[ CEILING ] ) ceiling = stof( options[ CEILING ].arg );
 //    if( options[ VERBOSE   ] ) verbose = true;
 //    if( options[ QUIET     ] ) quiet = true;
 //    if( options[ DXT1_QUALITY ] ) dxt1_quality = true;
     if( options[ OVERWRITE ] ) overwrite = true;
 
-    // output creation
-    SMF *smf = NULL;
     string fileName;
     if( options[ IFILE ] )
         fileName = options[ IFILE ].arg;
     else
         fileName = "rename_me.smf";
 
-    smf = SMF::open( fileName );
-    if(! smf ) smf = SMF::create( fileName, overwrite );
-    if(! smf ){
-        LOG(WARN) << "ERROR.main: unable to create " << fileName;
-        exit(1);
-    }
-    
-    for( int i = 0; i < parse.nonOptionsCount(); ++i ){
-        smf->addTileFile( parse.nonOption( i ) );
-    }
-
-    if( options[ TILESIZE ] ){
-        smf->setTileSize( stoi( options[ TILESIZE ].arg ) );
-    }
-
-
-    if( options[ MAPSIZE ] ){
-        valxval( options[ MAPSIZE ].arg, mx, my );
-        smf->setSize( mx, my );
-    }
-
-    if( options[ HEIGHT ] ){
-        if(! strcmp( options[ HEIGHT ].arg, "CLEAR" ) ){
-            LOG(INFO) << "INFO: Clearing Height\n";
-            smf->writeHeight(NULL);
+    // Load the source materials
+    // =========================
+    // 'CLEAR' leaves the layer NULL, which blanks it.
+    auto load = [&options]( int index, const char *name ) -> ImageBuf * {
+        if(! strcmp( options[ index ].arg, "CLEAR" ) ){
+            LOG(INFO) << "INFO: Clearing " << name << "\n";
+            return NULL;
         }
-        else {
-            ImageBuf heightBuf( options[ HEIGHT ].arg );
-            smf->writeHeight( &heightBuf );
-        }
-    }
-
-    if( options[ TYPE ] ){
-        if(! strcmp( options[ TYPE ].arg, "CLEAR" ) ){
-            LOG(INFO) << "INFO: Clearing Type\n";
-            smf->writeType(NULL);
-        }
-        else {
-            ImageBuf typeBuf( options[ TYPE ].arg );
-            smf->writeType( &typeBuf );
+        return new ImageBuf( options[ index ].arg );
+    };
+
+    ImageBuf *heightBuf = NULL, *typeBuf = NULL, *miniBuf = NULL,
+             *metalBuf = NULL, *grassBuf = NULL;
+    if( options[ HEIGHT ] ) heightBuf = load( HEIGHT, "Height" );
+    if( options[ TYPE ] ) typeBuf = load( TYPE, "Type" );
+    if( options[ MINI ] ) miniBuf = load( MINI, "Mini" );
+    if( options[ METAL ] ) metalBuf = load( METAL, "Metal" );
+    if( options[ GRASS ] ) grassBuf = load( GRASS, "Grass" );
+
+    auto filter = [&options]( int index ) -> ResampleFilter {
+        if(! strcmp( options[ index ].arg, "majority" ) ) return MAJORITY;
+        if( strcmp( options[ index ].arg, "nearest" ) ){
+            LOG(WARN) << "ERROR.main: unknown filter '" << options[ index ].arg
+                << "', expected 'nearest' or 'majority'";
+            exit(1);
         }
-    }
+        return NEAREST;
+    };
 
     SMF *smfTemp = NULL;
     TileMap *tileMap = NULL;
     if( options[ MAP ] ){
         if(! strcmp( options[ MAP ].arg, "CLEAR" ) ){
             LOG(INFO) << "INFO: Clearing Map\n";
-            smf->writeMap(NULL);
         }
         else if( (smfTemp = SMF::open( options[ MAP ].arg )) ){
-            smf->writeMap( smfTemp->getMap() );
+            tileMap = smfTemp->getMap();
             delete smfTemp;
         }
         else {
             tileMap = new TileMap( options[ MAP ].arg );
-            smf->writeMap( tileMap );
         }
     }
 
-    if( options[ MINI ] ){
-        if(! strcmp( options[ MINI ].arg, "CLEAR" ) ){
-            LOG(INFO) << "INFO: Clearing Mini\n";
-            smf->writeMini(NULL);
+    SMF *smf = NULL;
+    if(! overwrite ) smf = SMF::open( fileName );
+
+    if(! smf ){
+        // New map, collect everything and write it in one go
+        // ===================================================
+        SMF::Builder builder( fileName );
+
+        for( int i = 0; i < parse.nonOptionsCount(); ++i ){
+            builder.addTileFile( parse.nonOption( i ) );
         }
-        else {
-            ImageBuf miniBuf( options[ MINI ].arg );
-            smf->writeMini( &miniBuf );
+        if( options[ TILESIZE ] ){
+            builder.setTileSize( stoi( options[ TILESIZE ].arg ) );
         }
-    }
-
-    if( options[ METAL ] ){
-        if(! strcmp( options[ METAL ].arg, "CLEAR" ) ){
-            LOG(INFO) << "INFO: Clearing Metal\n";
-            smf->writeMetal(NULL);
+        if( options[ MAPSIZE ] ){
+            valxval( options[ MAPSIZE ].arg, mx, my );
+            builder.setSize( mx, my );
         }
-        else {
-            ImageBuf metalBuf( options[ METAL ].arg );
-            smf->writeMetal( &metalBuf );
+        if( options[ FLOOR ] || options[ CEILING ] ){
+            builder.setDepth( floor, ceiling );
+        }
+        if( options[ AUTO_DEPTH ] ) builder.setAutoDepth( true );
+        if( options[ FEATURES ] ){
+            builder.addFeatures( options[ FEATURES ].arg );
+        }
+        if( options[ TYPE_FILTER ] ){
+            builder.setTypeFilter( filter( TYPE_FILTER ) );
+        }
+        if( options[ METAL_FILTER ] ){
+            builder.setMetalFilter( filter( METAL_FILTER ) );
+        }
+
+        builder.setHeight( heightBuf );
+        builder.setType( typeBuf );
+        builder.setMap( tileMap );
+        builder.setMini( miniBuf );
+        builder.setMetal( metalBuf );
+        builder.setGrass( grassBuf );
+
+        if(! (smf = builder.write( overwrite )) ){
+            LOG(WARN) << "ERROR.main: unable to create " << fileName;
+            exit(1);
         }
     }
+    else {
+        // Existing map, modify it in place
+        // ================================
+        for( int i = 0; i < parse.nonOptionsCount(); ++i ){
+            smf->addTileFile( parse.nonOption( i ) );
+        }
 
-    if( options[ FEATURES ] ){
-        if(! strcmp( options[ FEATURES ].arg, "CLEAR" ) ){
-            LOG(INFO) << "INFO: Clearing Features\n";
-            smf->addFeatures("CLEAR");
+        if( options[ TILESIZE ] ){
+            smf->setTileSize( stoi( options[ TILESIZE ].arg ) );
         }
-        else {
-            smf->addFeatures( options[ FEATURES ].arg );
+
+        // only the values given change, the others stay as they were
+        if( options[ FLOOR ] || options[ CEILING ] ){
+            smf->setDepth(
+                options[ FLOOR ] ? floor : smf->getFloor(),
+                options[ CEILING ] ? ceiling : smf->getCeiling() );
         }
-    }
+        if( options[ AUTO_DEPTH ] ) smf->setAutoDepth( true );
 
-    if( options[ GRASS ] ){
-        if(! strcmp( options[ GRASS ].arg, "CLEAR" ) ){
-            LOG(INFO) << "INFO: Clearing Grass\n";
-            smf->writeGrass(NULL);
+        // before setSize, which may have to resample them
+        if( options[ TYPE_FILTER ] ){
+            smf->setTypeFilter( filter( TYPE_FILTER ) );
         }
-        else {
-            ImageBuf grassBuf( options[ GRASS ].arg );
-            smf->writeGrass( &grassBuf );
+        if( options[ METAL_FILTER ] ){
+            smf->setMetalFilter( filter( METAL_FILTER ) );
+        }
+
+        if( options[ MAPSIZE ] ){
+            valxval( options[ MAPSIZE ].arg, mx, my );
+            smf->setSize( mx, my );
         }
+
+        if( options[ HEIGHT ] ) smf->writeHeight( heightBuf );
+        if( options[ TYPE ] ) smf->writeType( typeBuf );
+        if( options[ MAP ] ) smf->writeMap( tileMap );
+        if( options[ MINI ] ) smf->writeMini( miniBuf );
+        if( options[ METAL ] ) smf->writeMetal( metalBuf );
+        if( options[ FEATURES ] ) smf->addFeatures( options[ FEATURES ].arg );
+        if( options[ GRASS ] ) smf->writeGrass( grassBuf );
     }
 
+    delete heightBuf;
+    delete typeBuf;
+    delete tileMap;
+    delete miniBuf;
+    delete metalBuf;
+    delete grassBuf;
+
     /// Finalise any pending changes.
     smf->reWrite();
 
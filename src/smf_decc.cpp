@@ -108,27 +108,40 @@ int main( int argc, char **argv )
     file.close();
 
 
+    // the raw layers are written straight from the mapped file
+    SMF::View view;
+
     LOG(INFO) << "INFO: Extracting height image";
-    buf = smf->getHeight();
-    buf->write("out_height.tif", "tif" );
+    if( (view = smf->viewHeight()).good() ){
+        buf = view.imageBuf();
+        buf->write("out_height.tif", "tif" );
+        delete buf;
+    }
 
     LOG(INFO) << "INFO: Extracting type image";
-    buf = smf->getType();
-    buf->write("out_type.tif", "tif");
+    if( (view = smf->viewType()).good() ){
+        buf = view.imageBuf();
+        buf->write("out_type.tif", "tif");
+        delete buf;
+    }
 
     LOG(INFO) << "INFO: Extracting map image";
     tileMap = smf->getMap();
-    file.open("out_tilemap.csv", std::ios::out );
-    file << tileMap->toCSV();
-    file.close();
+    tileMap->toCSV( "out_tilemap.csv" );
+    tileMap->toBinary( "out_tilemap.bin" );
+    delete tileMap;
 
     LOG(INFO) << "INFO: Extracting mini image";
     buf = smf->getMini();
     buf->write("out_mini.tif", "tif");
+    delete buf;
 
     LOG(INFO) << "INFO: Extracting metal image";
-    buf = smf->getMetal();
-    buf->write("out_metal.tif", "tif");
+    if( (view = smf->viewMetal()).good() ){
+        buf = view.imageBuf();
+        buf->write("out_metal.tif", "tif");
+        delete buf;
+    }
 
     LOG(INFO) << "INFO: Extracting featureList";
     file.open( "out_featuretypes.txt", std::ios::out );
@@ -140,10 +153,11 @@ int main( int argc, char **argv )
     file << smf->getFeatures();
     file.close();
 
-    buf = smf->getGrass();
-    if( buf ){
+    if( (view = smf->viewGrass()).good() ){
         LOG(INFO) << "INFO: Extracting grass image";
+        buf = view.imageBuf();
         buf->write("out_grass.tif", "tif");
+        delete buf;
     }
 
     return 0;
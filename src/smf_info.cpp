@@ -1,8 +1,12 @@
 #include "smf.h"
+#include "tilemap.h"
 
 #include "elog/elog.h"
 #include "optionparser/optionparser.h"
 
+#include <algorithm>
+#include <sstream>
+
 // Argument tests //
 ////////////////////
 struct Arg: public option::Arg
@@ -46,7 +50,8 @@ struct Arg: public option::Arg
 enum optionsIndex
 {
     UNKNOWN,
-    HELP
+    HELP,
+    TILESTATS
 };
 
 const option::Descriptor usage[] = {
@@ -55,9 +60,84 @@ const option::Descriptor usage[] = {
         "  eg. 'smf_info myfile.smf'\n"},
     { HELP, 0, "h", "help", Arg::None,
         "  -h,  \t--help  \tPrint usage and exit." },
+    { TILESTATS, 0, "", "tilestats", Arg::None,
+        "\t--tilestats  \tHow the tilemap uses the tiles; unique and "
+            "unused tiles per file, reference counts and the longest runs "
+            "of a repeated tile." },
     { 0, 0, 0, 0, 0, 0 }
 };
 
+/// print how the tilemap of the smf makes use of its tiles
+static void
+tileStats( SMF *smf )
+{
+    std::vector< std::string > fileNames = smf->getTileFileNames();
+    std::vector< uint32_t > fileNTiles = smf->getTileFileNTiles();
+    uint32_t nTiles = 0;
+    for( auto i = fileNTiles.begin(); i != fileNTiles.end(); ++i ) nTiles += *i;
+
+    // counted straight from the file, without reading it in
+    SMF::View map = smf->viewMap();
+    if(! map.good() ){
+        LOG(ERROR) << "cannot read the tilemap";
+        return;
+    }
+    TileMap::Stats stats = TileMap::getStats( map.data,
+            map.spec.width, map.spec.height, nTiles );
+    uint32_t nCells = map.spec.width * map.spec.height;
+
+    std::stringstream ss;
+    ss << "Tilemap Statistics\n"
+        << "\tcells:          " << nCells << "\n"
+        << "\ttiles:          " << nTiles << "\n"
+        << "\tunique:         " << stats.nUnique << "\n"
+        << "\tunused:         " << nTiles - stats.nUnique << "\n"
+        << "\tout of range:   " << stats.nOutOfRange << "\n";
+
+    ss << "\nUnused tiles per file\n";
+    for( uint32_t i = 0, first = 0; i < fileNTiles.size(); ++i ){
+        ss << "\t" << fileNames[ i ] << ": " << stats.unused( first,
+                fileNTiles[ i ] ) << " of " << fileNTiles[ i ] << "\n";
+        first += fileNTiles[ i ];
+    }
+
+    // tiles grouped by how often they are used, in powers of two
+    std::vector< uint32_t > buckets;
+    for( auto i = stats.histogram.begin(); i != stats.histogram.end(); ++i ){
+        if(! *i ) continue;
+        uint32_t bucket = 0;
+        while( *i >> (bucket + 1) ) ++bucket;
+        if( bucket >= buckets.size() ) buckets.resize( bucket + 1, 0 );
+        ++buckets[ bucket ];
+    }
+    ss << "\nTiles by number of references\n";
+    for( uint32_t i = 0; i < buckets.size(); ++i ){
+        ss << "\t" << (1u << i) << "-" << (2u << i) - 1 << ": "
+            << buckets[ i ] << "\n";
+    }
+
+    // most referenced tiles
+    std::vector< uint32_t > top( nTiles );
+    for( uint32_t i = 0; i < nTiles; ++i ) top[ i ] = i;
+    uint32_t nTop = std::min( nTiles, 10u );
+    std::partial_sort( top.begin(), top.begin() + nTop, top.end(),
+        [&stats]( uint32_t a, uint32_t b ){
+            return stats.histogram[ a ] > stats.histogram[ b ];
+        } );
+    ss << "\nMost referenced tiles\n";
+    for( uint32_t i = 0; i < nTop && stats.histogram[ top[ i ] ]; ++i ){
+        ss << "\ttile " << top[ i ] << ": "
+            << stats.histogram[ top[ i ] ] << "\n";
+    }
+
+    ss << "\nLongest runs of a single tile\n";
+    for( auto i = stats.runs.begin(); i != stats.runs.end(); ++i ){
+        ss << "\ttile " << i->tile << " x " << i->length
+            << " from " << i->x << "," << i->y << "\n";
+    }
+
+    LOG(INFO) << "\n" << ss.str();
+}
 
 int main( int argc, char **argv )
 {
@@ -94,5 +174,7 @@ int main( int argc, char **argv )
 
     LOG(INFO) << "\n" << smf->info();
 
+    if( options[ TILESTATS ] ) tileStats( smf );
+
     return 0;
 }
@@ -34,7 +34,7 @@ SMT::open( string fileName )
     ifstream file( fileName );
     if( file.good() ){
         file.read( (char *)magic, 16 );
-        if(! strcmp( magic, "spring tilefile" ) ){
+        if(! memcmp( magic, "spring tilefile", 16 ) ){
             good = true;
             file.close();
         }
@@ -189,29 +189,40 @@ SMT::append( ImageBuf *sourceBuf )
     file.close();
 }
 
-ImageBuf *
-SMT::getTile( uint32_t n )
+bool
+SMT::getTileDXT1( uint32_t n, char *blocks, uint32_t mip )
 {
-    ImageBuf *imageBuf = NULL;
-    ImageSpec imageSpec( header.tileSize, header.tileSize, 4, TypeDesc::UINT8 );
+    CHECK( mip < 4 ) << "tiles only store 4 mip levels";
 
-    char *raw_dxt1a = new char[ tileBytes ];
-    char *rgba8888 = new char[ header.tileSize * header.tileSize * 4 ];
+    // skip over the larger mip levels stored ahead of this one
+    uint32_t offset = 0;
+    for( uint32_t i = 0; i < mip; ++i ){
+        uint32_t mipSize = header.tileSize >> i;
+        offset += (mipSize * mipSize) / 2;
+    }
+    uint32_t size = header.tileSize >> mip;
 
     ifstream file( fileName );
-    if( file.good() )
-    {
-
-        file.seekg( sizeof(SMT::Header) + tileBytes * n );
-        file.read( (char *)raw_dxt1a, tileBytes );
-
-        squish::DecompressImage( (squish::u8 *)rgba8888,
-                header.tileSize, header.tileSize, raw_dxt1a, squish::kDxt1 );
+    if(! file.good() ) return false;
+    file.seekg( sizeof(SMT::Header) + tileBytes * n + offset );
+    file.read( blocks, (size * size) / 2 );
+    return file.good();
+}
 
-        imageBuf = new ImageBuf( fileName + "_" + to_string(n), imageSpec, rgba8888);
+ImageBuf *
+SMT::getTile( uint32_t n, uint32_t mip )
+{
+    ImageBuf *imageBuf = NULL;
+    uint32_t size = header.tileSize >> mip;
+    ImageSpec imageSpec( size, size, 4, TypeDesc::UINT8 );
+
+    char *raw_dxt1a = new char[ (size * size) / 2 ];
+    if( getTileDXT1( n, raw_dxt1a, mip ) ){
+        imageBuf = new ImageBuf( fileName + "_" + to_string(n), imageSpec );
+        squish::DecompressImage( (squish::u8 *)imageBuf->localpixels(),
+                size, size, raw_dxt1a, squish::kDxt1 );
     }
     delete [] raw_dxt1a;
-    file.close();
 
 #ifdef DEBUG_IMG
     imageBuf->write("getTile(" + to_string(n) + ").tif", "tif");
@@ -63,7 +63,10 @@ public:
     uint32_t getTileBytes( ){ return tileBytes;       };
     std::string getFileName( ){ return fileName; };
 
-    OpenImageIO::ImageBuf *getTile( uint32_t tile );
+    /// decode a tile, or one of the smaller mip levels stored with it
+    OpenImageIO::ImageBuf *getTile( uint32_t tile, uint32_t mip = 0 );
+    /// read the compressed blocks of a tile mip level without decoding
+    bool getTileDXT1( uint32_t tile, char *blocks, uint32_t mip = 0 );
     void append( OpenImageIO::ImageBuf * );
 };
 
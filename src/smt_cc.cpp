@@ -79,7 +79,10 @@ enum optionsIndex
     // Deconstruction
     SEPARATE,
     COLLATE,
-    RECONSTRUCT
+    RECONSTRUCT,
+    MIP,
+    DDS,
+    EXPORT
 };
 
 const option::Descriptor usage[] = {
@@ -139,8 +142,18 @@ const option::Descriptor usage[] = {
     { RECONSTRUCT, 0, "", "reconstruct", Arg::Required,
         "  \t--reconstruct=tilemap.exr  \tReconstruct the extracted tiles "
             "using a tilemap." },
-    { TILEMAP, 0, "", "tilemap", Arg::None,
-        "  \t--tilemap  \t" },
+    { TILEMAP, 0, "", "tilemap", Arg::Required,
+        "  \t--tilemap=map.smf  \tSmf, csv or binary tilemap file to "
+            "arrange the tiles by." },
+    { MIP, 0, "", "mip", Arg::Numeric,
+        "  \t--mip=[0-3]  \tReconstruct from the mip levels stored in the "
+            "tiles, each level halves the size of the image." },
+    { DDS, 0, "", "dds", Arg::Required,
+        "  \t--dds=out.dds  \tReconstruct into a DXT1 dds file, copying the "
+            "compressed tiles without decoding them." },
+    { EXPORT, 0, "", "export", Arg::Required,
+        "  \t--export=out.tif  \tReconstruct into an image file, the format "
+            "is taken from the extension." },
 
     { UNKNOWN, 0, "", "", Arg::None,
         "\nEXAMPLES:\n"
@@ -195,12 +208,14 @@ main( int argc, char **argv )
     TiledImage tiledImage;
 
     // Import the filenames into the source image tilecache
+    vector< string > sources;
     for( int i = 0; i < parse.nonOptionsCount(); ++i ){
         LOG(INFO) << "Adding " << parse.nonOption( i ) << " to tileCache.";
-        tiledImage.tileCache.addSource( parse.nonOption( i ) );
+        sources.push_back( parse.nonOption( i ) );
     }
+    tiledImage.tileCache.addSources( sources );
 
-    CHECK(! tiledImage.tileCache.getNTiles() ) << "no tiles in cache";
+    CHECK( tiledImage.tileCache.getNTiles() ) << "no tiles in cache";
 
     // Source the tilemap, or generate it
     if( options[ TILEMAP ] ){
@@ -208,25 +223,30 @@ main( int argc, char **argv )
         if( (smf = SMF::open( options[ TILEMAP ].arg )) ){
             TileMap *tileMap = smf->getMap();
             tiledImage.setTileMap( *tileMap );
+            delete tileMap;
             delete smf;
         }
-        if(! smf ){
-            tiledImage.mapFromCSV( options[ RECONSTRUCT ].arg );
+        else {
+            tiledImage.setTileMap( TileMap( options[ TILEMAP ].arg ) );
         }
     }
     else {
         tiledImage.squareFromCache();
     }
 
-    // test pulling large image.
-    ImageBuf *big = tiledImage.getRegion(0, 0);
-    if( big ){ 
-        big->write("test.jpg", "jpg");
+    uint32_t mip = 0;
+    if( options[ MIP ] ) mip = stoi( options[ MIP ].arg );
+    CHECK( mip < 4 ) << "mip must be 0 to 3";
 
-        fstream file("tilemap.csv", ios::out);
-        file << tiledImage.tileMap.toCSV();
-        file.close();
-    }
+    // reconstruct the whole image, a row of tiles at a time.
+    bool exported = false;
+    if( options[ DDS ] )
+        exported = tiledImage.exportDXT1( options[ DDS ].arg );
+    if( options[ EXPORT ] )
+        exported |= tiledImage.exportRegion( options[ EXPORT ].arg,
+                0, 0, 0, 0, mip );
+
+    if( exported ) tiledImage.tileMap.toCSV( "tilemap.csv" );
 
 
 
@@ -0,0 +1,113 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+
+// CONSTRUCTORS
+// ============
+ThreadPool::ThreadPool( uint32_t n )
+    : nThreads( n )
+{
+    if(! nThreads ) nThreads = std::thread::hardware_concurrency();
+    if(! nThreads ) nThreads = 1;
+}
+
+ThreadPool::~ThreadPool( )
+{
+    {
+        std::unique_lock< std::mutex > lock( mutex );
+        stop = true;
+    }
+    condition.notify_all();
+    for( auto i = workers.begin(); i != workers.end(); ++i ) i->join();
+}
+
+// WORKERS
+// =======
+void
+ThreadPool::start( )
+{
+    for( uint32_t i = 0; i < nThreads; ++i )
+        workers.push_back( std::thread( &ThreadPool::work, this ) );
+}
+
+void
+ThreadPool::work( )
+{
+    std::function< void() > job;
+    while( true ){
+        {
+            std::unique_lock< std::mutex > lock( mutex );
+            condition.wait( lock, [this](){ return stop || !jobs.empty(); } );
+            // remaining jobs are drained before exiting so no future is
+            // left without a value
+            if( jobs.empty() ) return;
+            job = std::move( jobs.front() );
+            jobs.pop_front();
+        }
+        job();
+    }
+}
+
+void
+ThreadPool::push( std::function< void() > job )
+{
+    {
+        std::unique_lock< std::mutex > lock( mutex );
+        if( workers.empty() ) start();
+        jobs.push_back( std::move( job ) );
+    }
+    condition.notify_one();
+}
+
+// ALGORITHMS
+// ==========
+void
+ThreadPool::parallelFor( uint32_t n, std::function< void( uint32_t ) > f )
+{
+    if(! n ) return;
+
+    // shared so that helpers which only get scheduled after the work is
+    // done never touch a dead stack frame.
+    struct State {
+        std::function< void( uint32_t ) > f;
+        uint32_t n;
+        std::atomic< uint32_t > next;
+        uint32_t done = 0;
+        std::exception_ptr error;
+        std::mutex mutex;
+        std::condition_variable finished;
+    };
+    auto state = std::make_shared< State >();
+    state->f = f;
+    state->n = n;
+    state->next = 0;
+
+    auto run = [state](){
+        uint32_t i, count = 0;
+        while( (i = state->next++) < state->n ){
+            try {
+                state->f( i );
+            }
+            catch( ... ){
+                std::unique_lock< std::mutex > lock( state->mutex );
+                if(! state->error ) state->error = std::current_exception();
+            }
+            ++count;
+        }
+        if(! count ) return;
+
+        std::unique_lock< std::mutex > lock( state->mutex );
+        state->done += count;
+        if( state->done == state->n ) state->finished.notify_all();
+    };
+
+    uint32_t helpers = std::min( nThreads, n ) - 1;
+    for( uint32_t i = 0; i < helpers; ++i ) push( run );
+    run();
+
+    std::unique_lock< std::mutex > lock( state->mutex );
+    state->finished.wait( lock, [state](){ return state->done == state->n; } );
+    if( state->error ) std::rethrow_exception( state->error );
+}
@@ -0,0 +1,67 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+/// Fixed size pool of worker threads
+/** Threads are started lazily on the first job, so a pool that is never
+ *  used costs nothing. Jobs are run in the order they were queued.
+ */
+class ThreadPool
+{
+    // member data
+    uint32_t nThreads;
+    bool stop = false;
+    std::vector< std::thread > workers;
+    std::deque< std::function< void() > > jobs;
+    std::mutex mutex;
+    std::condition_variable condition;
+
+    void start( );
+    void work( );
+    void push( std::function< void() > job );
+
+public:
+    //constructors
+    ThreadPool( uint32_t n = 0 ); //< n = 0 uses the hardware concurrency
+    ~ThreadPool( );
+
+    ThreadPool( const ThreadPool & ) = delete;
+    ThreadPool &operator=( const ThreadPool & ) = delete;
+
+    // data access
+    uint32_t getNThreads( ){ return nThreads; };
+
+    /// queue a job, the result is available through the returned future
+    template< typename F >
+    std::future< typename std::result_of< F() >::type > enqueue( F f );
+
+    /// call f( i ) for every i in [0, n) and wait for them all to finish
+    /*  The calling thread takes part in the work, so it is safe to call
+     *  from inside another job. The first exception thrown by f is
+     *  re-thrown here once all iterations are complete.
+     */
+    void parallelFor( uint32_t n, std::function< void( uint32_t ) > f );
+};
+
+template< typename F >
+std::future< typename std::result_of< F() >::type >
+ThreadPool::enqueue( F f )
+{
+    typedef typename std::result_of< F() >::type R;
+    auto task = std::make_shared< std::packaged_task< R() > >( f );
+    std::future< R > result = task->get_future();
+    push( [task](){ (*task)(); } );
+    return result;
+}
+
+#endif //THREADPOOL_H
@@ -6,34 +6,45 @@
 #include "smf.h"
 
 #include "elog/elog.h"
+#include <squish.h>
 #include <OpenImageIO/imagebuf.h>
 #include <OpenImageIO/imagebufalgo.h>
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
 #include <string>
 
 OIIO_NAMESPACE_USING;
 
+uint32_t
+TileCache::locate( uint32_t n, uint32_t &local )
+{
+    // map holds the running total of tiles at the end of each file
+    uint32_t file = std::upper_bound( map.begin(), map.end(), n ) - map.begin();
+    local = n - (file ? map[ file - 1 ] : 0);
+    return file;
+}
+
 ImageBuf *
-TileCache::getOriginal( uint32_t n )
+TileCache::getOriginal( uint32_t n, uint32_t mip )
 {
     ImageBuf *tileBuf = NULL;
-    ImageInput *image = NULL;
     SMT *smt = NULL;
-    if( n > nTiles ) return NULL;
+    if( n >= nTiles ) return NULL;
 
-    auto i = map.begin();
-    auto fileName = fileNames.begin();
-    while( *i <= n ) { ++i; ++fileName; }
+    uint32_t local;
+    uint32_t file = locate( n, local );
 
-    if( (smt = SMT::open( *fileName )) ){
-        tileBuf = smt->getTile( n - *i + smt->getNTiles() );
-        LOG(INFO) << "request: " << n << " - tiles to date: " << *i
-            << " + tiles in file: " << smt->getNTiles() << " = " 
-            << n - *i + smt->getNTiles();
+    if( fileTypes[ file ] == Source::SMT
+            && (smt = SMT::open( fileNames[ file ] )) ){
+        tileBuf = smt->getTile( local, mip );
+        LOG(INFO) << "request: " << n << " - tiles to date: " << map[ file ]
+            << " + tiles in file: " << smt->getNTiles() << " = " << local;
         delete smt;
     }
-    else if( (image = ImageInput::open( *fileName )) ){
-        tileBuf =  new ImageBuf( *fileName );
-        delete image;
+    else if( fileTypes[ file ] == Source::IMAGE ){
+        tileBuf =  new ImageBuf( fileNames[ file ] );
 
         // Load
         tileBuf->read( 0, 0, false, TypeDesc::UINT8 );
@@ -49,18 +60,40 @@ TileCache::getOriginal( uint32_t n )
 
 
 ImageBuf *
-TileCache::getScaled( uint32_t n, uint32_t w, uint32_t h )
+TileCache::getScaled( uint32_t n, uint32_t w, uint32_t h, uint32_t mip )
+{
+    if( h == 0 ) h = w;
+
+    // Use the prefetched tile if there is one
+    Pending pending;
+    {
+        std::lock_guard< std::mutex > lock( prefetchMutex );
+        auto i = prefetched.find( n );
+        if( i != prefetched.end() && w == prefetchWidth
+                && h == prefetchHeight && mip == prefetchMip )
+            pending = i->second;
+    }
+    if(! pending.valid() ) return loadScaled( n, w, h, mip );
+
+    // the same tile may be referenced many times, so hand out copies.
+    std::shared_ptr< ImageBuf > tileBuf = pending.get();
+    if(! tileBuf ) return NULL;
+    ImageBuf *copy = new ImageBuf;
+    copy->copy( *tileBuf );
+    return copy;
+}
+
+ImageBuf *
+TileCache::loadScaled( uint32_t n, uint32_t w, uint32_t h, uint32_t mip )
 {
     ImageBuf *tileBuf = NULL;
-    if(! (tileBuf = getOriginal( n )) )return NULL;
+    if(! (tileBuf = getOriginal( n, mip )) )return NULL;
     ImageSpec spec = tileBuf->spec();
 
-    if( h == 0 ) h = w;
-
     // Scale the tile to match output requirements
     ImageBuf fixBuf; 
     ROI roi( 0, w, 0, h, 0, 1, 0, 4 );
-    if( w != 0 || spec.width != roi.xend || spec.height != roi.yend ){
+    if( spec.width != roi.xend || spec.height != roi.yend ){
 //            printf( "WARNING: Image is (%i,%i), wanted (%i, %i),"
 //                " Resampling.\n",
 //                spec.width, spec.height, roi.xend, roi.yend );
@@ -82,41 +115,166 @@ TileCache::getScaled( uint32_t n, uint32_t w, uint32_t h )
     return tileBuf;
 }
 
+bool
+TileCache::getDXT1( uint32_t n, uint32_t size, char *blocks )
+{
+    SMT *smt = NULL;
+    if( n >= nTiles ) return false;
+
+    uint32_t local;
+    uint32_t file = locate( n, local );
+
+    // Copy the compressed data when the smt already has it at this size.
+    if( fileTypes[ file ] == Source::SMT
+            && (smt = SMT::open( fileNames[ file ] )) ){
+        bool good = false;
+        if( smt->getTileSize() == size
+                && smt->getTileType() == SMT::TileType::DXT1 ){
+            good = smt->getTileDXT1( local, blocks );
+        }
+        delete smt;
+        if( good ) return true;
+    }
+
+    // Everything else is decoded, scaled and compressed.
+    ImageBuf *tileBuf = NULL;
+    if(! (tileBuf = getScaled( n, size, size )) ) return false;
+    std::vector< squish::u8 > rgba( size * size * 4 );
+    tileBuf->get_pixels( ROI( 0, size, 0, size, 0, 1, 0, 4 ),
+            TypeDesc::UINT8, rgba.data() );
+    delete tileBuf;
+
+    squish::CompressImage( rgba.data(), size, size, blocks, squish::kDxt1 );
+    return true;
+}
+
 void
-TileCache::addSource( std::string fileName )
+TileCache::prefetch( const std::vector< uint32_t > &indices,
+        uint32_t w, uint32_t h, uint32_t mip )
 {
-    ImageInput *image;
-    ImageSpec spec;
-    if( (image = ImageInput::open( fileName )) ){
-        nTiles++;
-        map.push_back( nTiles );
-        fileNames.push_back( fileName );
+    if( h == 0 ) h = w;
 
-        delete image;
-        return;
+    std::lock_guard< std::mutex > lock( prefetchMutex );
+    std::map< uint32_t, Pending > next;
+    bool sameSize = ( w == prefetchWidth && h == prefetchHeight
+            && mip == prefetchMip );
+    for( auto i = indices.begin(); i != indices.end(); ++i ){
+        if( next.count( *i ) ) continue;
+
+        // keep tiles that are already loaded, or on their way
+        auto j = prefetched.find( *i );
+        if( sameSize && j != prefetched.end() ){
+            next[ *i ] = j->second;
+            continue;
+        }
+
+        uint32_t n = *i;
+        next[ n ] = pool.enqueue( [this, n, w, h, mip](){
+            return std::shared_ptr< ImageBuf >( loadScaled( n, w, h, mip ) );
+        } ).share();
     }
 
-    SMT *smt = NULL;
-    if( (smt = SMT::open( fileName )) ){
-        if(! smt->getNTiles() ) return;
-        nTiles += smt->getNTiles();
-        map.push_back( nTiles );
-        fileNames.push_back( fileName );
+    // anything dropped here is freed once its job completes
+    prefetched.swap( next );
+    prefetchWidth = w;
+    prefetchHeight = h;
+    prefetchMip = mip;
+}
 
-        delete smt;
-        return;
+TileCache::Source
+TileCache::probe( std::string fileName )
+{
+    Source source;
+
+    // Magic numbers we can recognise without asking OpenImageIO
+    static const struct { const char *magic; uint32_t size; } images[] = {
+        { "\x89PNG",           4 },
+        { "\xFF\xD8\xFF",      3 }, // jpeg
+        { "II*\0",             4 }, // tiff, little endian
+        { "MM\0*",             4 }, // tiff, big endian
+        { "\x76\x2F\x31\x01", 4 }, // openexr
+        { "DDS ",              4 },
+        { "BM",                2 },
+        { "GIF8",              4 }
+    };
+
+    char magic[ 16 ] = "";
+    std::ifstream file( fileName, std::ios::binary );
+    if(! file.good() ) return source;
+    file.read( magic, 16 );
+    uint32_t size = file.gcount();
+    file.close();
+
+    if( size == 16 && !memcmp( magic, "spring tilefile", 16 ) ){
+        SMT *smt = NULL;
+        if( (smt = SMT::open( fileName )) ){
+            source.type = Source::SMT;
+            source.nTiles = smt->getNTiles();
+            delete smt;
+        }
+        return source;
     }
 
-    SMF *smf = NULL;
-    if( (smf = SMF::open( fileName )) ){
-        // get the fileNames here
-        std::vector< std::string > smtList = smf->getTileFileNames();
-        for( auto i = smtList.begin(); i != smtList.end(); ++i ){
-            addSource( *i );
+    if( size == 16 && !memcmp( magic, "spring map file", 16 ) ){
+        SMF *smf = NULL;
+        if( (smf = SMF::open( fileName )) ){
+            source.type = Source::SMF;
+            source.smtList = smf->getTileFileNames();
+            delete smf;
         }
-        delete smf;
-        return;
+        return source;
+    }
+
+    for( auto i = std::begin( images ); i != std::end( images ); ++i ){
+        if( size >= i->size && !memcmp( magic, i->magic, i->size ) ){
+            source.type = Source::IMAGE;
+            source.nTiles = 1;
+            return source;
+        }
+    }
+
+    // Fall back to letting the plugins sniff it, eg targa has no magic.
+    ImageInput *image = NULL;
+    if( (image = ImageInput::open( fileName )) ){
+        source.type = Source::IMAGE;
+        source.nTiles = 1;
+        delete image;
     }
+    return source;
+}
 
-    LOG(ERROR) << "unrecognised format: " << fileName;
+void
+TileCache::addSource( std::string fileName )
+{
+    addSources( std::vector< std::string >( 1, fileName ) );
+}
+
+void
+TileCache::addSources( const std::vector< std::string > &sourceNames )
+{
+    // Probing is independent per file, its only the numbering that has
+    // to follow the order given.
+    std::vector< Source > sources( sourceNames.size() );
+    pool.parallelFor( sourceNames.size(), [&]( uint32_t i ){
+        sources[ i ] = probe( sourceNames[ i ] );
+    } );
+
+    for( uint32_t i = 0; i < sources.size(); ++i ){
+        switch( sources[ i ].type ){
+            case Source::IMAGE:
+            case Source::SMT:
+                if(! sources[ i ].nTiles ) break;
+                nTiles += sources[ i ].nTiles;
+                map.push_back( nTiles );
+                fileNames.push_back( sourceNames[ i ] );
+                fileTypes.push_back( sources[ i ].type );
+                break;
+            case Source::SMF:
+                // the smf only references tiles, add the files it names
+                addSources( sources[ i ].smtList );
+                break;
+            default:
+                LOG(ERROR) << "unrecognised format: " << sourceNames[ i ];
+        }
+    }
 }
@@ -1,26 +1,87 @@
 #ifndef TILECACHE_H
 #define TILECACHE_H
 
+#include "threadpool.h"
+
 #include <OpenImageIO/imagebuf.h>
+#include <future>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <vector>
 #include <string>
 
 class TileCache
 {
+    /// What a source file turned out to be when probed
+    struct Source {
+        enum Type { UNKNOWN, IMAGE, SMT, SMF } type = UNKNOWN;
+        uint32_t nTiles = 0;
+        std::vector< std::string > smtList; //< tile files referenced by an smf
+    };
+    static Source probe( std::string fileName );
+
     // member data
     uint32_t nTiles = 0;
     std::vector< uint32_t > map;
     std::vector< std::string > fileNames;
+    std::vector< Source::Type > fileTypes;
+
+    // prefetched tiles, keyed by tile index
+    typedef std::shared_future< std::shared_ptr< OpenImageIO::ImageBuf > >
+        Pending;
+    std::mutex prefetchMutex;
+    std::map< uint32_t, Pending > prefetched;
+    uint32_t prefetchWidth = 0;
+    uint32_t prefetchHeight = 0;
+    uint32_t prefetchMip = 0;
+
+    // declared last so that its workers are joined before anything they
+    // reference is destroyed
+    ThreadPool pool;
+
+    /// find the file holding tile n, and the index of the tile within it
+    uint32_t locate( uint32_t n, uint32_t &local );
+
+    OpenImageIO::ImageBuf *loadScaled( uint32_t n,
+            uint32_t w, uint32_t h, uint32_t mip );
 
 public:
     // modifications
     void addSource( std::string );
 
+    /// Add many source files at once
+    /*  The files are probed in parallel, recognising them by their magic
+     *  number where possible. Tiles are numbered exactly as if each file
+     *  had been passed to addSource() in turn.
+     */
+    void addSources( const std::vector< std::string > &fileNames );
+
+    /// Load and decode tiles in the background
+    /*  The tiles in indices are scaled to w x h on background threads, and
+     *  getScaled() hands them out without blocking on I/O. Each call
+     *  replaces the previous set, so pass the tiles of the rows you are
+     *  about to read, and any still in use.
+     */
+    void prefetch( const std::vector< uint32_t > &indices,
+            uint32_t w, uint32_t h = 0, uint32_t mip = 0 );
+
     // data access
+    // getOriginal and getScaled may be called from many threads at once, as
+    // long as no sources are being added at the same time.
     uint32_t getNTiles ( ){ return nTiles; };
     uint32_t getNFiles ( ){ return fileNames.size(); };
-    OpenImageIO::ImageBuf *getOriginal( uint32_t n );
-    OpenImageIO::ImageBuf* getScaled( uint32_t n, uint32_t w, uint32_t h = 0 );
+    // mip selects one of the reduced levels stored in smt files, image
+    // files only have the one level and are scaled down instead.
+    OpenImageIO::ImageBuf *getOriginal( uint32_t n, uint32_t mip = 0 );
+    OpenImageIO::ImageBuf* getScaled( uint32_t n, uint32_t w, uint32_t h = 0,
+            uint32_t mip = 0 );
+
+    /// DXT1 blocks of tile n at size x size
+    /*  Smt tiles of that size are copied without decoding, other sources
+     *  are scaled and compressed. blocks must hold size * size / 2 bytes.
+     */
+    bool getDXT1( uint32_t n, uint32_t size, char *blocks );
 };
 
 #endif //TILECACHE_H
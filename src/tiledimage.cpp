@@ -3,9 +3,14 @@
 #include "tilecache.h"
 
 #include "elog/elog.h"
+#include <OpenImageIO/imageio.h>
 #include <OpenImageIO/imagebuf.h>
 #include <OpenImageIO/imagebufalgo.h>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <vector>
 
 // CONSTRUCTORS
 // ============
@@ -27,8 +32,8 @@ TiledImage::TiledImage( uint32_t w, uint32_t h, uint32_t tw, uint32_t th )
 void
 TiledImage::setTileMap( TileMap tm )
 {
-    CHECK(! tm.width ) << "tilemap has no width";
-    CHECK(! tm.height ) << "tilemap has no height";
+    CHECK( tm.width ) << "tilemap has no width";
+    CHECK( tm.height ) << "tilemap has no height";
 
     tileMap = tm;
     mw = tileMap.width;
@@ -40,15 +45,15 @@ TiledImage::setTileMap( TileMap tm )
 void
 TiledImage::setSize( uint32_t w, uint32_t h )
 {
-    CHECK( w < tw )
+    CHECK( w >= tw )
         << "pixel width must be >= tile width (" << tw << ")";
-    CHECK(! w % tw )
+    CHECK( w % tw == 0 )
         << "pixel width must be a multiple of tile width (" << tw << ")";
 
-    CHECK( h < th )
-        << "pixel height must be >= tile height (" << tw << ")";
-    CHECK(! h % th )
-        << "pixel height must be a multiple of tile height (" << tw << ")";
+    CHECK( h >= th )
+        << "pixel height must be >= tile height (" << th << ")";
+    CHECK( h % th == 0 )
+        << "pixel height must be a multiple of tile height (" << th << ")";
 
     pw = w;
     ph = h;
@@ -61,8 +66,8 @@ TiledImage::setSize( uint32_t w, uint32_t h )
 void
 TiledImage::setTileSize( uint32_t w, uint32_t h )
 {
-    CHECK( w < 4 ) << "width must be >= 4";
-    CHECK( h < 4 ) << "height must be >= 4";
+    CHECK( w >= 4 ) << "width must be >= 4";
+    CHECK( h >= 4 ) << "height must be >= 4";
     
     tw = w;
     th = h;
@@ -90,7 +95,7 @@ TiledImage::squareFromCache( )
 {
     // early out
     int tc;
-    CHECK(! (tc = tileCache.getNTiles()) ) << "tileCache has no tiles";
+    CHECK( (tc = tileCache.getNTiles()) ) << "tileCache has no tiles";
     mw = mh = sqrt( tc );
     pw = ph = mw * tw;
     tileMap.setSize( mw, mh );
@@ -99,69 +104,308 @@ TiledImage::squareFromCache( )
 
 // ACCESS
 // ======
+
+/// copy the window of src to dest at dx, dy
+/*  Tiles and regions are both 4 channel UINT8 in memory, so the rows can
+ *  be copied directly; anything else goes through ImageBufAlgo::paste.
+ */
+static void
+blit( OpenImageIO::ImageBuf *dest, uint32_t dx, uint32_t dy,
+        OpenImageIO::ImageBuf *src, OpenImageIO::ROI window )
+{
+    OIIO_NAMESPACE_USING;
+    const ImageSpec &srcSpec = src->spec();
+    const ImageSpec &destSpec = dest->spec();
+    uint8_t *srcPixels = (uint8_t *)src->localpixels();
+    uint8_t *destPixels = (uint8_t *)dest->localpixels();
+
+    if(! srcPixels || ! destPixels
+            || srcSpec.format != TypeDesc::UINT8
+            || destSpec.format != TypeDesc::UINT8
+            || srcSpec.nchannels != 4 || destSpec.nchannels != 4 ){
+        ImageBufAlgo::paste( *dest, dx, dy, 0, 0, *src, window );
+        return;
+    }
+
+    size_t srcStride = srcSpec.width * 4;
+    size_t destStride = destSpec.width * 4;
+    size_t rowBytes = (window.xend - window.xbegin) * 4;
+    srcPixels += window.ybegin * srcStride + window.xbegin * 4;
+    destPixels += dy * destStride + dx * 4;
+    for( int y = window.ybegin; y < window.yend; ++y ){
+        memcpy( destPixels, srcPixels, rowBytes );
+        srcPixels += srcStride;
+        destPixels += destStride;
+    }
+}
+
 OpenImageIO::ImageBuf *
-TiledImage::getRegion( uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2 )
+TiledImage::getRegion( uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2,
+        uint32_t mip )
 {
     OIIO_NAMESPACE_USING;
 
-    CHECK( x1 > pw ) << "x1 is out of range";
-    CHECK( y1 > pw ) << "y1 is out of range";
-    if( x2 == 0 || x2 > pw ) x2 = pw;
-    if( y2 == 0 || y2 > pw ) y2 = ph;
+    // tile and pixel dimensions at the requested mip level
+    uint32_t mtw = tw >> mip;
+    uint32_t mth = th >> mip;
+    CHECK( mtw && mth ) << "mip level " << mip << " is smaller than a pixel";
+    uint32_t mpw = mw * mtw;
+    uint32_t mph = mh * mth;
+
+    CHECK( x1 < mpw ) << "x1 is out of range";
+    CHECK( y1 < mph ) << "y1 is out of range";
+    if( x2 == 0 || x2 > mpw ) x2 = mpw;
+    if( y2 == 0 || y2 > mph ) y2 = mph;
+    CHECK( x1 < x2 && y1 < y2 ) << "region is empty";
 
     ImageSpec spec( x2 - x1, y2 - y1, 4, TypeDesc::UINT8 );
     ImageBuf *dest = new ImageBuf( spec );
-    //current point of interest
-    uint32_t ix = x1;
-    uint32_t iy = y1;
-    while( true ){
 
-        //determine the tile under the point of interest
-        uint32_t mx = ix / tw;
-        uint32_t my = iy / th;
+    //determine the block of tiles that covers the region
+    uint32_t mx1 = x1 / mtw;
+    uint32_t my1 = y1 / mth;
+    uint32_t cols = (x2 - 1) / mtw + 1 - mx1;
+    uint32_t rows = (y2 - 1) / mth + 1 - my1;
+
+    // Maps repeat tiles heavily, so gather the unique indices first and
+    // decode each of them only once.
+    std::vector< uint32_t > indices( cols * rows );
+    for( uint32_t i = 0; i < indices.size(); ++i )
+        indices[ i ] = tileMap( mx1 + i % cols, my1 + i / cols );
 
-        //determine the top left corner of the copy window
-        uint32_t wx1 = ix - mx * tw;
-        uint32_t wy1 = iy - my * th;
+    std::vector< uint32_t > unique( indices );
+    std::sort( unique.begin(), unique.end() );
+    unique.erase( std::unique( unique.begin(), unique.end() ), unique.end() );
+    LOG(INFO) << "getRegion: " << unique.size() << " unique of "
+        << indices.size() << " tiles ("
+        << 100.0 * unique.size() / indices.size() << "%)";
 
-        //determine the bottom right corner of the copy window
-        uint32_t wx2 = std::min( tw, x2 - ix );
-        uint32_t wy2 = std::min( th, y2 - iy );
+    std::vector< ImageBuf * > tiles( unique.size(), NULL );
+    pool.parallelFor( unique.size(), [&]( uint32_t i ){
+        tiles[ i ] = tileCache.getScaled( unique[ i ], mtw, mth, mip );
+    } );
 
-        //determine the dimensions of the copy window
-        uint32_t ww = wx2 - wx1;
-        uint32_t wh = wy2 - wy1;
+    // Then scatter them, every cell lands in its own part of dest, so they
+    // can be copied independently.
+    pool.parallelFor( indices.size(), [&]( uint32_t i ){
+        uint32_t mx = mx1 + i % cols;
+        uint32_t my = my1 + i / cols;
+
+        //determine the copy window in tile coordinates
+        uint32_t wx1 = std::max( x1, mx * mtw ) - mx * mtw;
+        uint32_t wy1 = std::max( y1, my * mth ) - my * mth;
+        uint32_t wx2 = std::min( x2, mx * mtw + mtw ) - mx * mtw;
+        uint32_t wy2 = std::min( y2, my * mth + mth ) - my * mth;
 
         //determine the top left of the paste window
-        uint32_t dx = ix - x1;
-        uint32_t dy = iy - y1;
-
-        uint32_t index = tileMap(mx, my);
-        ImageBuf *tile = tileCache.getScaled( index, tw, th );
-        if( tile ){
-            //copy pixel data from source tile to dest
-            ROI window;
-            window.xbegin = wx1;
-            window.xend = wx2;
-            window.ybegin = wy1;
-            window.yend = wy2;
-            window.zbegin = 0;
-            window.zend = 1;
-            window.chbegin = 0;
-            window.chend = 4;
-            ImageBufAlgo::paste( *dest, dx, dy, 0, 0, *tile, window );
+        uint32_t dx = mx * mtw + wx1 - x1;
+        uint32_t dy = my * mth + wy1 - y1;
+
+        auto slot = std::lower_bound( unique.begin(), unique.end(),
+                indices[ i ] );
+        ImageBuf *tile = tiles[ slot - unique.begin() ];
+        if(! tile ) return;
+
+        //copy pixel data from source tile to dest
+        ROI window( wx1, wx2, wy1, wy2, 0, 1, 0, 4 );
+        blit( dest, dx, dy, tile, window );
+    } );
+
+    for( auto i = tiles.begin(); i != tiles.end(); ++i ) delete *i;
+    return dest;
+}
+
+void
+TiledImage::prefetchRows( uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2,
+        uint32_t mip )
+{
+    uint32_t mtw = tw >> mip;
+    uint32_t mth = th >> mip;
+
+    std::vector< uint32_t > indices;
+    for( uint32_t my = y1 / mth; my * mth < y2; ++my )
+    for( uint32_t mx = x1 / mtw; mx * mtw < x2; ++mx ){
+        indices.push_back( tileMap( mx, my ) );
+    }
+    tileCache.prefetch( indices, mtw, mth, mip );
+}
+
+bool
+TiledImage::exportRegion( std::string fileName,
+        uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2, uint32_t mip )
+{
+    OIIO_NAMESPACE_USING;
+
+    uint32_t mtw = tw >> mip;
+    uint32_t mth = th >> mip;
+    CHECK( mtw && mth ) << "mip level " << mip << " is smaller than a pixel";
+    uint32_t mpw = mw * mtw;
+    uint32_t mph = mh * mth;
+
+    CHECK( x1 < mpw ) << "x1 is out of range";
+    CHECK( y1 < mph ) << "y1 is out of range";
+    if( x2 == 0 || x2 > mpw ) x2 = mpw;
+    if( y2 == 0 || y2 > mph ) y2 = mph;
+    CHECK( x1 < x2 && y1 < y2 ) << "region is empty";
+
+    ImageOutput *out = ImageOutput::create( fileName );
+    if(! out ){
+        LOG(ERROR) << "cannot create " << fileName << ": "
+            << OpenImageIO::geterror();
+        return false;
+    }
+
+    // formats that support it, like tiff and exr, get written a tile at a
+    // time, everything else by scanline. Their tiles must be multiples of
+    // 16 pixels, which small mip levels are not.
+    ImageSpec spec( x2 - x1, y2 - y1, 4, TypeDesc::UINT8 );
+    bool tiled = out->supports( "tiles" ) && mtw % 16 == 0 && mth % 16 == 0;
+    if( tiled ){
+        spec.tile_width = mtw;
+        spec.tile_height = mth;
+    }
+    if(! out->open( fileName, spec ) ){
+        LOG(ERROR) << "cannot open " << fileName << ": " << out->geterror();
+        delete out;
+        return false;
+    }
+
+    // Produce the image one band of tile height at a time, only the band
+    // and the tiles being prefetched for the next one are held in memory.
+    bool good = true;
+    for( uint32_t oy = 0; good && oy < (uint32_t)spec.height; oy += mth ){
+        uint32_t by1 = y1 + oy;
+        uint32_t by2 = std::min( y2, by1 + mth );
+
+        prefetchRows( x1, by1, x2, std::min( y2, by2 + mth ), mip );
+        ImageBuf *band = getRegion( x1, by1, x2, by2, mip );
+        if( tiled ){
+            good = out->write_tiles( 0, spec.width, oy, oy + by2 - by1, 0, 1,
+                    TypeDesc::UINT8, band->localpixels() );
         }
+        else {
+            good = out->write_scanlines( oy, oy + by2 - by1, 0,
+                    TypeDesc::UINT8, band->localpixels() );
+        }
+        delete band;
+    }
+    if(! good ) LOG(ERROR) << "writing " << fileName << ": " << out->geterror();
+
+    out->close();
+    delete out;
+    return good;
+}
+
+/// DDS file header as written on disk, 128 bytes including the magic
+struct DDSHeader {
+    char magic[ 4 ] = { 'D', 'D', 'S', ' ' };
+    uint32_t size = 124;
+    uint32_t flags = 0x81007;   //< caps, height, width, pixelformat, linearsize
+    uint32_t height = 0;
+    uint32_t width = 0;
+    uint32_t linearSize = 0;
+    uint32_t depth = 0;
+    uint32_t mipMapCount = 0;
+    uint32_t reserved1[ 11 ] = { 0 };
+    uint32_t pfSize = 32;
+    uint32_t pfFlags = 0x4;     //< fourcc
+    char     pfFourCC[ 4 ] = { 'D', 'X', 'T', '1' };
+    uint32_t pfBitCount = 0;
+    uint32_t pfMasks[ 4 ] = { 0 };
+    uint32_t caps = 0x1000;     //< texture
+    uint32_t caps2 = 0;
+    uint32_t reserved2[ 3 ] = { 0 };
+};
+
+bool
+TiledImage::exportDXT1( std::string fileName,
+        uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2 )
+{
+    if( x2 == 0 || x2 > pw ) x2 = pw;
+    if( y2 == 0 || y2 > ph ) y2 = ph;
+    CHECK( x1 < x2 && y1 < y2 ) << "region is empty";
+
+    std::fstream file( fileName, std::ios::binary | std::ios::out );
+    if(! file.good() ){
+        LOG(ERROR) << "cannot open " << fileName;
+        return false;
+    }
 
-        //determine the next point of interest
-        ix += ww;
-        if( ix >= x2 ){
-            ix = x1;
-            iy += wh;
-            if( iy >= y2 ){
-                //then weve copied all the data and exit;
-                break;
+    DDSHeader header;
+    header.width = x2 - x1;
+    header.height = y2 - y1;
+    header.linearSize = ((x2 - x1) / 4) * ((y2 - y1) / 4) * 8;
+    file.write( (char *)&header, sizeof(DDSHeader) );
+
+    bool good = exportDXT1( file, x1, y1, x2, y2 );
+    if(! good ) LOG(ERROR) << "writing " << fileName;
+    file.close();
+    return good;
+}
+
+bool
+TiledImage::exportDXT1( std::ostream &file,
+        uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2 )
+{
+    CHECK( x1 < pw ) << "x1 is out of range";
+    CHECK( y1 < ph ) << "y1 is out of range";
+    if( x2 == 0 || x2 > pw ) x2 = pw;
+    if( y2 == 0 || y2 > ph ) y2 = ph;
+    CHECK( x1 < x2 && y1 < y2 ) << "region is empty";
+    CHECK(! (x1 % 4 || y1 % 4 || x2 % 4 || y2 % 4) )
+        << "region must be aligned to 4x4 blocks";
+    CHECK(! (tw % 4 || th % 4) ) << "tiles must be a multiple of 4 pixels";
+
+    // sizes in 4x4 blocks of 8 bytes
+    uint32_t bw = (x2 - x1) / 4;
+    uint32_t tbw = tw / 4;
+    uint32_t tbh = th / 4;
+    uint32_t tileBytes = tbw * tbh * 8;
+
+    // Work through one row of tiles at a time, the blocks are copied from
+    // the tiles as they are, only the row being written is held in memory.
+    std::vector< char > band( bw * tbh * 8 );
+    uint32_t mx1 = x1 / tw;
+    uint32_t cols = (x2 - 1) / tw + 1 - mx1;
+    for( uint32_t by1 = y1, by2; by1 < y2; by1 = by2 ){
+        uint32_t my = by1 / th;
+        by2 = std::min( y2, my * th + th );
+
+        std::vector< uint32_t > indices( cols );
+        for( uint32_t i = 0; i < cols; ++i )
+            indices[ i ] = tileMap( mx1 + i, my );
+
+        std::vector< uint32_t > unique( indices );
+        std::sort( unique.begin(), unique.end() );
+        unique.erase( std::unique( unique.begin(), unique.end() ),
+                unique.end() );
+
+        // missing tiles are left as zeroed blocks, which decode to black
+        std::vector< char > tiles( unique.size() * tileBytes, 0 );
+        pool.parallelFor( unique.size(), [&]( uint32_t i ){
+            tileCache.getDXT1( unique[ i ], tw, &tiles[ i * tileBytes ] );
+        } );
+
+        //block rows of the tile that fall inside the region
+        uint32_t wby1 = (by1 - my * th) / 4;
+        uint32_t wby2 = (by2 - my * th) / 4;
+        pool.parallelFor( cols, [&]( uint32_t i ){
+            uint32_t mx = mx1 + i;
+            uint32_t wbx1 = (std::max( x1, mx * tw ) - mx * tw) / 4;
+            uint32_t wbx2 = (std::min( x2, mx * tw + tw ) - mx * tw) / 4;
+            uint32_t dbx = (mx * tw + wbx1 * 4 - x1) / 4;
+
+            auto slot = std::lower_bound( unique.begin(), unique.end(),
+                    indices[ i ] );
+            char *src = &tiles[ (slot - unique.begin()) * tileBytes ];
+            for( uint32_t by = wby1; by < wby2; ++by ){
+                memcpy( &band[ ((by - wby1) * bw + dbx) * 8 ],
+                        src + (by * tbw + wbx1) * 8,
+                        (wbx2 - wbx1) * 8 );
             }
-        }
+        } );
+
+        file.write( band.data(), (wby2 - wby1) * bw * 8 );
     }
-    return dest;
+    return file.good();
 }
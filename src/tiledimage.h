@@ -3,12 +3,21 @@
 
 #include "tilemap.h"
 #include "tilecache.h"
+#include "threadpool.h"
 
 #include <cstdint>
+#include <ostream>
+#include <string>
 #include <OpenImageIO/imagebuf.h>
 
 class TiledImage
 {
+    ThreadPool pool; //< workers for region assembly
+
+    /// prefetch the tiles under the pixel rectangle x1,y1 - x2,y2
+    void prefetchRows( uint32_t x1, uint32_t y1, uint32_t x2, uint32_t y2,
+            uint32_t mip );
+
     // data members
 public:
     TileMap tileMap; //< tile map
@@ -36,7 +45,39 @@ public:
     void squareFromCache();
 
     // data access
+    /// assemble the pixels of a region from its tiles
+    /*  Each unique tile in the region is decoded once, then copied to all
+     *  the places it is used, both on a pool of worker threads.
+     *  x2 and y2 of zero extend the region to the edge of the image.
+     *
+     *  A mip level above zero builds the region from the reduced tiles
+     *  stored in smt files, each level halves the size, and coordinates
+     *  are given in pixels of that level.
+     */
     OpenImageIO::ImageBuf *getRegion(
+            uint32_t x1 = 0, uint32_t y1 = 0,
+            uint32_t x2 = 0, uint32_t y2 = 0,
+            uint32_t mip = 0 );
+
+    /// write a region straight to an image file
+    /*  Unlike getRegion the whole region is never held in memory, it is
+     *  assembled and written one row of tiles at a time, using tiles when
+     *  the output format supports them.
+     */
+    bool exportRegion( std::string fileName,
+            uint32_t x1 = 0, uint32_t y1 = 0,
+            uint32_t x2 = 0, uint32_t y2 = 0,
+            uint32_t mip = 0 );
+
+    /// write a region as a DXT1 compressed dds file
+    /*  The blocks of smt tiles are copied as they are stored, without
+     *  decoding and re-encoding. The region must be aligned to 4x4 blocks.
+     */
+    bool exportDXT1( std::string fileName,
+            uint32_t x1 = 0, uint32_t y1 = 0,
+            uint32_t x2 = 0, uint32_t y2 = 0 );
+    /// write just the blocks of the region, row after row, to a stream
+    bool exportDXT1( std::ostream &file,
             uint32_t x1 = 0, uint32_t y1 = 0,
             uint32_t x2 = 0, uint32_t y2 = 0 );
 };
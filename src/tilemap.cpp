@@ -1,12 +1,14 @@
 #include "tilemap.h"
+#include "mappedfile.h"
 
 #include "elog/elog.h"
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
 #include <fstream>
 #include <string>
 #include <sstream>
 #include <vector>
-#include <stdexcept>
 
 // CONSTRUCTORS
 // ============
@@ -22,77 +24,232 @@ TileMap::TileMap( uint32_t w,  uint32_t h )
 
 TileMap::TileMap( std::string fileName )
 {
-    fromCSV( fileName );
+    load( fileName );
 }
 
 // IMPORT
 // ======
+void
+TileMap::load( std::string fileName )
+{
+    BinaryHeader header;
+    char magic[ sizeof(header.magic) ] = { 0 };
+    std::ifstream file( fileName, std::ios::in | std::ios::binary );
+    CHECK( file.good() ) << "cannot open " << fileName;
+    file.read( magic, sizeof(magic) );
+    file.close();
+
+    if(! memcmp( magic, header.magic, sizeof(magic) ) ) fromBinary( fileName );
+    else fromCSV( fileName );
+}
+
+void
+TileMap::fromBinary( std::string fileName )
+{
+    MappedFile file( fileName );
+    CHECK( file.good() ) << "cannot open " << fileName;
+
+    BinaryHeader header;
+    CHECK( file.size() >= sizeof(header) ) << fileName << " is truncated";
+    memcpy( &header, file.data(), sizeof(header) );
+    CHECK(! memcmp( header.magic, BinaryHeader().magic, sizeof(header.magic) ) )
+        << fileName << " is not a binary tilemap";
+    CHECK( header.version == 1 )
+        << fileName << ": unknown tilemap version " << header.version;
+    CHECK( header.indexBytes == 2 || header.indexBytes == 4 )
+        << fileName << ": bad index size " << header.indexBytes;
+
+    uint64_t cells = (uint64_t)header.width * header.height;
+    CHECK( file.size() - sizeof(header) >= cells * header.indexBytes )
+        << fileName << " is truncated";
+
+    width = header.width;
+    height = header.height;
+    map.resize( cells );
+
+    const char *indices = file.data() + sizeof(header);
+    if( header.indexBytes == 4 ){
+        memcpy( map.data(), indices, cells * 4 );
+    }
+    else {
+        const uint16_t *in = (const uint16_t *)indices;
+        std::copy( in, in + cells, map.begin() );
+    }
+}
+
 void
 TileMap::fromCSV( std::string fileName )
 {
     // reset
     width = height = 0;
-    // setup
-    std::string cell;
-    std::stringstream line;
-    std::vector< std::string > tokens;
-    std::fstream file( fileName, std::ios::in );
-    CHECK(! file.good() ) << "cannot open " << fileName;
-
-    // get dimensions
-    if( std::getline( file, cell ) ) ++height;
-    else return;
-
-    line.str( cell );
-    while( std::getline( line, cell, ',' ) ) ++width;
-    while( std::getline( file, cell ) ) ++height;
-
-    //reserve space to avoid many memory allocations
-    map.resize( width * height );
+    map.clear();
 
-    // convert csv
-    file.seekg(0);
-    uint32_t y = 0;
-    while( std::getline( file, cell ) ){
-        line.str( cell );
+    MappedFile file( fileName );
+    CHECK( file.good() ) << "cannot open " << fileName;
 
-        tokens.clear();
-        while( std::getline( line, cell, ',' ) ) tokens.push_back( cell );
+    const char *p = file.data();
+    const char *end = p + file.size();
+    const char *lineStart = p;
+    uint32_t line = 1, x = 0, errors = 0;
 
-        uint32_t x = 0;
-        for( auto i = tokens.begin(); i != tokens.end(); ++i ){
-            try {
-                map[x + width * y] = stoi( *i );
-            }
-            catch( std::invalid_argument ){
-                map[x + width * y] = 0;
-            }
-            ++x;
+    // bad cells are read as zero, only the first few are reported
+    auto report = [&]( const char *at, const char *what ){
+        if( errors++ < 10 ) LOG(WARN) << fileName << ":" << line << ":"
+            << at - lineStart + 1 << ": " << what;
+    };
+
+    // finish the row at p, the first row sets the width
+    auto endRow = [&](){
+        if(! height ){
+            width = x;
+            // guess the height from the length of the first line so the
+            // map is allocated once for evenly formatted files
+            size_t lineLength = p - lineStart + 1;
+            map.reserve( width * (file.size() / lineLength + 1) );
         }
-        ++y;
+        else if( x < width ){
+            report( p, "too few cells in row" );
+            map.resize( map.size() + width - x, 0 );
+        }
+        ++height;
+        x = 0;
+    };
+
+    while( p < end ){
+        while( p < end && (*p == ' ' || *p == '\t') ) ++p;
+
+        // blank lines are skipped
+        if(! x && (p == end || *p == '\n' || *p == '\r') ){
+            if( p < end && *p++ == '\n' ){ ++line; lineStart = p; }
+            continue;
+        }
+
+        // cell value
+        const char *cell = p;
+        uint64_t value = 0;
+        while( p < end && (unsigned char)(*p - '0') < 10 && p - cell < 11 ){
+            value = value * 10 + (*p++ - '0');
+        }
+        while( p < end && (*p == ' ' || *p == '\t') ) ++p;
+
+        bool separator = p == end || *p == ',' || *p == '\n' || *p == '\r';
+        if( p == cell || ! separator || value > UINT32_MAX ){
+            report( cell, "not a tile index" );
+            value = 0;
+            while( p < end && *p != ',' && *p != '\n' && *p != '\r' ) ++p;
+        }
+
+        if(! height || x < width ) map.push_back( value );
+        else if( x == width ) report( cell, "too many cells in row" );
+        ++x;
+
+        if( p < end && *p == ',' ){
+            ++p;
+            // a trailing comma does not start another cell
+            if( p < end && *p != '\n' && *p != '\r' ) continue;
+        }
+
+        endRow();
+        if( p < end && *p == '\r' ) ++p;
+        if( p < end && *p == '\n' ) ++p;
+        ++line;
+        lineStart = p;
     }
-    file.close();
+
+    if( errors > 10 ) LOG(WARN) << fileName << ": " << errors - 10
+        << " more bad cells not shown";
+    map.shrink_to_fit();
 }
 
 std::string
 TileMap::toCSV( )
 {
-    std::stringstream ss;
-    uint32_t j = 1;
+    std::ostringstream ss;
+    toCSV( ss );
+    return ss.str();
+}
+
+void
+TileMap::toCSV( std::ostream &out )
+{
+    // formatted into a fixed buffer and written out in large chunks, a
+    // cell is at most ten digits and a separator.
+    const uint32_t bufferSize = 64 * 1024;
+    char buffer[ bufferSize ];
+    char *p = buffer;
+
+    uint32_t x = 0;
     for( auto i = map.begin(); i != map.end(); ++i ){
-        ss << *i;
-        if( j % width ) ss << ",";
-        else ss << "\n";
-        ++j;
+        if( p > buffer + bufferSize - 11 ){
+            out.write( buffer, p - buffer );
+            p = buffer;
+        }
+
+        // digits are produced backwards, then reversed in place
+        uint32_t value = *i;
+        char *first = p;
+        do {
+            *p++ = '0' + value % 10;
+            value /= 10;
+        } while( value );
+        std::reverse( first, p );
+
+        if( ++x < width ) *p++ = ',';
+        else {
+            *p++ = '\n';
+            x = 0;
+        }
     }
-    return ss.str();
+    out.write( buffer, p - buffer );
+}
+
+bool
+TileMap::toCSV( std::string fileName )
+{
+    std::ofstream file( fileName, std::ios::out | std::ios::binary );
+    if(! file.good() ){
+        LOG(ERROR) << "cannot open " << fileName;
+        return true;
+    }
+    toCSV( file );
+    file.close();
+    return file.fail();
+}
+
+bool
+TileMap::toBinary( std::string fileName )
+{
+    BinaryHeader header;
+    header.width = width;
+    header.height = height;
+    if( std::all_of( map.begin(), map.end(),
+                []( uint32_t i ){ return i <= UINT16_MAX; } ) ){
+        header.indexBytes = 2;
+    }
+
+    std::ofstream file( fileName, std::ios::out | std::ios::binary );
+    if(! file.good() ){
+        LOG(ERROR) << "cannot open " << fileName;
+        return true;
+    }
+    file.write( (char *)&header, sizeof(header) );
+
+    if( header.indexBytes == 4 ){
+        file.write( (char *)map.data(), map.size() * 4 );
+    }
+    else {
+        std::vector< uint16_t > indices( map.begin(), map.end() );
+        file.write( (char *)indices.data(), indices.size() * 2 );
+    }
+    file.close();
+    return file.fail();
 }
 
 void
 TileMap::setSize( uint32_t w, uint32_t h )
 {
-    CHECK(! w ) << "Width must be >= 1";
-    CHECK(! h ) << "Height must be >= 1";
+    CHECK( w ) << "Width must be >= 1";
+    CHECK( h ) << "Height must be >= 1";
 
     width = w; height = h;
     map.resize( width * height );
@@ -109,6 +266,79 @@ TileMap::consecutive( )
     }
 }
 
+// ANALYSIS
+// ========
+TileMap::Stats
+TileMap::getStats( uint32_t nTiles, uint32_t nRuns )
+{
+    return getStats( map.data(), width, height, nTiles, nRuns );
+}
+
+TileMap::Stats
+TileMap::getStats( const void *cells, uint32_t width, uint32_t height,
+        uint32_t nTiles, uint32_t nRuns )
+{
+    Stats stats;
+    stats.nTiles = nTiles;
+    stats.histogram.resize( nTiles, 0 );
+    uint32_t *histogram = stats.histogram.data();
+
+    // the shortest of the longest runs so far is on top
+    auto shorter = []( const Stats::Run &a, const Stats::Run &b ){
+        return a.length > b.length;
+    };
+    std::vector< Stats::Run > runs;
+    runs.reserve( nRuns + 1 );
+
+    auto endRun = [&]( Stats::Run &run ){
+        if( run.length < 2 || ! nRuns ) return;
+        if( runs.size() == nRuns && run.length <= runs.front().length ) return;
+        runs.push_back( run );
+        std::push_heap( runs.begin(), runs.end(), shorter );
+        if( runs.size() > nRuns ){
+            std::pop_heap( runs.begin(), runs.end(), shorter );
+            runs.pop_back();
+        }
+    };
+
+    const char *cell = (const char *)cells;
+    for( uint32_t y = 0; y < height; ++y ){
+        Stats::Run run;
+        run.y = y;
+        for( uint32_t x = 0; x < width; ++x, cell += 4 ){
+            uint32_t tile;
+            memcpy( &tile, cell, 4 );
+            if( tile < nTiles ) ++histogram[ tile ];
+            else ++stats.nOutOfRange;
+
+            if( run.length && tile == run.tile ){
+                ++run.length;
+                continue;
+            }
+            endRun( run );
+            run.x = x;
+            run.length = 1;
+            run.tile = tile;
+        }
+        endRun( run );
+    }
+
+    stats.nUnique = nTiles - std::count( histogram, histogram + nTiles, 0 );
+
+    std::sort_heap( runs.begin(), runs.end(), shorter );
+    stats.runs = runs;
+    return stats;
+}
+
+uint32_t
+TileMap::Stats::unused( uint32_t first, uint32_t count ) const
+{
+    CHECK( first + count <= histogram.size() )
+        << "tiles " << first << "-" << first + count << " out of range";
+    return std::count( histogram.begin() + first,
+            histogram.begin() + first + count, 0 );
+}
+
 // ACCESS
 // ======
 uint32_t &
@@ -122,7 +352,7 @@ TileMap::operator() ( uint32_t x, uint32_t y )
 uint32_t &
 TileMap::operator() ( uint32_t idx )
 {
-    CHECK( idx >= map.size() ) << idx << " out of range";
+    CHECK( idx < map.size() ) << idx << " out of range";
     return map[idx];
 }
 
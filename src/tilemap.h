@@ -2,12 +2,45 @@
 #define TILEMAP_H
 
 #include <cstdint>
+#include <ostream>
 #include <vector>
 #include <string>
 
 class TileMap
 {
 public:
+    /// Header of the binary tilemap format
+    /*  Followed by width * height little endian indices of indexBytes
+     *  each, row after row. Two byte indices are used when every index
+     *  fits, so maps of fewer than 65536 tiles are half the size.
+     */
+    struct BinaryHeader {
+        char magic[ 8 ] = "tilemap"; //< "tilemap\0"
+        uint32_t version = 1;
+        uint32_t width = 0;
+        uint32_t height = 0;
+        uint32_t indexBytes = 4; //< 2 or 4
+    };
+
+    /// How a map makes use of its tiles, see getStats()
+    struct Stats {
+        /// horizontal run of a single tile
+        struct Run {
+            uint32_t x = 0, y = 0; //< first cell of the run
+            uint32_t length = 0;
+            uint32_t tile = 0;
+        };
+
+        uint32_t nTiles = 0;      //< size of the tile range counted
+        uint32_t nUnique = 0;     //< tiles referenced at least once
+        uint32_t nOutOfRange = 0; //< cells referencing tiles >= nTiles
+        std::vector< uint32_t > histogram; //< references to each tile
+        std::vector< Run > runs;  //< longest runs, longest first
+
+        /// number of tiles in [first, first + count) never referenced
+        uint32_t unused( uint32_t first, uint32_t count ) const;
+    };
+
     // data members
     uint32_t width;
     uint32_t height;
@@ -16,13 +49,34 @@ public:
     // constructors
     TileMap( );
     TileMap( uint32_t w, uint32_t h );
-    TileMap( std::string fileName );
+    TileMap( std::string fileName ); //< see load()
 
     //import
+    /// read a binary or csv tilemap, telling them apart by the magic
+    void load( std::string fileName );
+
+    /// read a tilemap in the binary format, see BinaryHeader
+    /*  The file is mapped and its indices copied into the map, two byte
+     *  ones widened as they go. That copy is deliberate: TiledImage, the
+     *  smf writer and everything else that takes a TileMap want an owned,
+     *  writable array of uint32, and would copy a mapped view anyway. The
+     *  format saves the parsing, not the memory.
+     */
+    void fromBinary( std::string fileName );
+
+    /// read a comma separated grid of tile indices
+    /*  The width is taken from the first row, shorter rows are padded and
+     *  longer ones truncated. Cells that are not indices are read as zero
+     *  and reported with their line and column.
+     */
     void fromCSV( std::string fileName );
     
     //export
     std::string toCSV();
+    /// stream the csv out without building it in memory first
+    void toCSV( std::ostream &out );
+    bool toCSV( std::string fileName );
+    bool toBinary( std::string fileName );
 
     //modification
     void setSize( uint32_t w, uint32_t h );
@@ -30,6 +84,19 @@ public:
     //generation
     void consecutive( );
 
+    //analysis
+    /// count the references to each of nTiles tiles in a single pass
+    /*  Also finds the nRuns longest horizontal runs of a repeated tile.
+     */
+    Stats getStats( uint32_t nTiles, uint32_t nRuns = 10 );
+    /// the same over any width x height array of indices, eg. an smf view
+    /*  cells holds 4 byte host order indices and need not be aligned, an
+     *  smf tilemap section usually is not, each one is loaded with memcpy.
+     */
+    static Stats getStats( const void *cells,
+            uint32_t width, uint32_t height,
+            uint32_t nTiles, uint32_t nRuns = 10 );
+
     //access
     uint32_t &operator() ( uint32_t y, uint32_t x );
     uint32_t &operator() ( uint32_t idx );
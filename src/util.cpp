@@ -2,10 +2,17 @@
 
 #include <OpenImageIO/imagebuf.h>
 #include <OpenImageIO/imagebufalgo.h>
+#include <algorithm>
 #include <cstdint>
+#include <cstring>
+#include <limits>
 #include <string>
 #include <vector>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 void
 valxval( std::string s, uint32_t &x, uint32_t &y )
 {
@@ -111,4 +118,292 @@ channels( OpenImageIO::ImageBuf *sourceBuf, OpenImageIO::ImageSpec spec )
     return resultBuf;
 }
 
+// FUSED CONVERSION
+// ================
+// Sample conversions, rounded to nearest the same as OIIO.
+static inline void sample( uint8_t in, uint8_t &out ){ out = in; }
+static inline void sample( uint16_t in, uint8_t &out ){
+    out = (in * 255u + 32767u) / 65535u;
+}
+static inline void sample( float in, uint8_t &out ){
+    out = std::min( std::max( in, 0.0f ), 1.0f ) * 255.0f + 0.5f;
+}
+static inline void sample( uint8_t in, uint16_t &out ){ out = in * 257u; }
+static inline void sample( uint16_t in, uint16_t &out ){ out = in; }
+static inline void sample( float in, uint16_t &out ){
+    out = std::min( std::max( in, 0.0f ), 1.0f ) * 65535.0f + 0.5f;
+}
+
+/// convert n contiguous samples, used when no pixels are skipped
+template< typename S, typename D >
+static void
+convertRow( const S *in, D *out, uint32_t n )
+{
+    for( uint32_t i = 0; i < n; ++i ) sample( in[ i ], out[ i ] );
+}
+
+static void
+convertRow( const uint8_t *in, uint8_t *out, uint32_t n )
+{
+    memcpy( out, in, n );
+}
+
+static void
+convertRow( const uint16_t *in, uint16_t *out, uint32_t n )
+{
+    memcpy( out, in, n * 2 );
+}
+
+#ifdef __SSE2__
+static void
+convertRow( const uint8_t *in, uint16_t *out, uint32_t n )
+{
+    // v * 257 is v in both bytes
+    uint32_t i = 0;
+    for( ; i + 16 <= n; i += 16 ){
+        __m128i v = _mm_loadu_si128( (const __m128i *)(in + i) );
+        _mm_storeu_si128( (__m128i *)(out + i), _mm_unpacklo_epi8( v, v ) );
+        _mm_storeu_si128( (__m128i *)(out + i + 8), _mm_unpackhi_epi8( v, v ) );
+    }
+    for( ; i < n; ++i ) sample( in[ i ], out[ i ] );
+}
+
+static void
+convertRow( const uint16_t *in, uint8_t *out, uint32_t n )
+{
+    // round( v / 257 ) == ( mulhi( v, 0xFF01 ) + 0x80 ) >> 8 for all v
+    const __m128i m = _mm_set1_epi16( (short)0xFF01 );
+    const __m128i half = _mm_set1_epi16( 0x80 );
+    uint32_t i = 0;
+    for( ; i + 16 <= n; i += 16 ){
+        __m128i a = _mm_loadu_si128( (const __m128i *)(in + i) );
+        __m128i b = _mm_loadu_si128( (const __m128i *)(in + i + 8) );
+        a = _mm_srli_epi16( _mm_add_epi16( _mm_mulhi_epu16( a, m ), half ), 8 );
+        b = _mm_srli_epi16( _mm_add_epi16( _mm_mulhi_epu16( b, m ), half ), 8 );
+        _mm_storeu_si128( (__m128i *)(out + i), _mm_packus_epi16( a, b ) );
+    }
+    for( ; i < n; ++i ) sample( in[ i ], out[ i ] );
+}
+#endif //__SSE2__
+
+/// nearest pixel resample, channel mapping and format conversion in one
+template< typename S, typename D >
+static void
+convertImage( const S *in, int sw, int sh, int sc,
+        D *out, int dw, int dh, int dc )
+{
+    // the source pixel under the centre of each destination pixel
+    std::vector< int > sx( dw );
+    for( int x = 0; x < dw; ++x ) sx[ x ] = ((2 * x + 1) * (int64_t)sw) / (2 * dw);
+
+    // missing channels are black, or opaque for alpha
+    D fill[ 4 ] = { 0, 0, 0, std::numeric_limits< D >::max() };
+
+    for( int y = 0; y < dh; ++y, out += dw * dc ){
+        int sy = ((2 * y + 1) * (int64_t)sh) / (2 * dh);
+        const S *row = in + (size_t)sy * sw * sc;
+
+        if( sw == dw && sc == dc ){
+            convertRow( row, out, dw * dc );
+            continue;
+        }
+
+        D *pixel = out;
+        for( int x = 0; x < dw; ++x, pixel += dc ){
+            const S *source = row + sx[ x ] * sc;
+            for( int c = 0; c < dc; ++c ){
+                if( c < sc ) sample( source[ c ], pixel[ c ] );
+                else pixel[ c ] = fill[ std::min( c, 3 ) ];
+            }
+        }
+    }
+}
+
+/// first and one past the last source pixel under each output pixel
+static std::vector< int >
+footprints( int sourceSize, int size )
+{
+    std::vector< int > edges( size + 1 );
+    for( int i = 0; i <= size; ++i )
+        edges[ i ] = ((int64_t)i * sourceSize) / size;
+    return edges;
+}
+
+/// most common pixel under each output pixel, ties go to the lowest
+template< typename S, typename D >
+static void
+majorityImage( const S *in, int sw, int sh, int sc,
+        D *out, int dw, int dh, int dc )
+{
+    std::vector< int > fx = footprints( sw, dw ), fy = footprints( sh, dh );
+    D fill[ 4 ] = { 0, 0, 0, std::numeric_limits< D >::max() };
+
+    // whole pixels are compared, packed into a single key
+    std::vector< uint64_t > keys;
+    for( int y = 0; y < dh; ++y )
+    for( int x = 0; x < dw; ++x, out += dc ){
+        keys.clear();
+        for( int sy = fy[ y ]; sy < std::max( fy[ y + 1 ], fy[ y ] + 1 ); ++sy )
+        for( int sx = fx[ x ]; sx < std::max( fx[ x + 1 ], fx[ x ] + 1 ); ++sx ){
+            const S *source = in + ((size_t)sy * sw + sx) * sc;
+            uint64_t key = 0;
+            for( int c = 0; c < dc; ++c ){
+                D v = fill[ std::min( c, 3 ) ];
+                if( c < sc ) sample( source[ c ], v );
+                key = (key << 16) | v;
+            }
+            keys.push_back( key );
+        }
+        std::sort( keys.begin(), keys.end() );
 
+        uint64_t best = keys[ 0 ];
+        size_t bestCount = 0;
+        for( size_t i = 0, j; i < keys.size(); i = j ){
+            for( j = i + 1; j < keys.size() && keys[ j ] == keys[ i ]; ++j );
+            if( j - i > bestCount ){
+                best = keys[ i ];
+                bestCount = j - i;
+            }
+        }
+        for( int c = dc - 1; c >= 0; --c, best >>= 16 ) out[ c ] = best;
+    }
+}
+
+/// the usual case of a single 8 bit channel, counted in a histogram
+template< typename S >
+static void
+majorityImage( const S *in, int sw, int sh, int sc,
+        uint8_t *out, int dw, int dh, int dc )
+{
+    if( dc != 1 ){
+        majorityImage< S, uint8_t >( in, sw, sh, sc, out, dw, dh, dc );
+        return;
+    }
+
+    std::vector< int > fx = footprints( sw, dw ), fy = footprints( sh, dh );
+    uint32_t counts[ 256 ] = { 0 };
+    for( int y = 0; y < dh; ++y )
+    for( int x = 0; x < dw; ++x, ++out ){
+        int x1 = fx[ x ], x2 = std::max( fx[ x + 1 ], x1 + 1 );
+        int y1 = fy[ y ], y2 = std::max( fy[ y + 1 ], y1 + 1 );
+
+        for( int sy = y1; sy < y2; ++sy ){
+            const S *source = in + ((size_t)sy * sw + x1) * sc;
+            for( int sx = x1; sx < x2; ++sx, source += sc ){
+                uint8_t v;
+                sample( *source, v );
+                ++counts[ v ];
+            }
+        }
+
+        // only the values seen are looked at again, and cleared
+        uint8_t best = 0;
+        uint32_t bestCount = 0;
+        for( int sy = y1; sy < y2; ++sy ){
+            const S *source = in + ((size_t)sy * sw + x1) * sc;
+            for( int sx = x1; sx < x2; ++sx, source += sc ){
+                uint8_t v;
+                sample( *source, v );
+                if( counts[ v ] > bestCount
+                        || (counts[ v ] == bestCount && v < best) ){
+                    best = v;
+                    bestCount = counts[ v ];
+                }
+            }
+        }
+        for( int sy = y1; sy < y2; ++sy ){
+            const S *source = in + ((size_t)sy * sw + x1) * sc;
+            for( int sx = x1; sx < x2; ++sx, source += sc ){
+                uint8_t v;
+                sample( *source, v );
+                counts[ v ] = 0;
+            }
+        }
+        *out = best;
+    }
+}
+
+template< typename S, typename D >
+static void
+resampleImage( const S *in, int sw, int sh, int sc,
+        D *out, int dw, int dh, int dc, ResampleFilter filter )
+{
+    // a majority only differs from the nearest pixel when shrinking, and
+    // pixels of more than four channels do not fit in a key
+    if( filter == MAJORITY && (sw > dw || sh > dh) && dc <= 4 )
+        majorityImage( in, sw, sh, sc, out, dw, dh, dc );
+    else
+        convertImage( in, sw, sh, sc, out, dw, dh, dc );
+}
+
+template< typename D >
+static void
+convertFrom( const void *in, OpenImageIO::TypeDesc format, int sw, int sh,
+        int sc, D *out, int dw, int dh, int dc, ResampleFilter filter )
+{
+    OIIO_NAMESPACE_USING;
+    if( format == TypeDesc::UINT8 )
+        resampleImage( (const uint8_t *)in, sw, sh, sc, out, dw, dh, dc,
+                filter );
+    else if( format == TypeDesc::UINT16 )
+        resampleImage( (const uint16_t *)in, sw, sh, sc, out, dw, dh, dc,
+                filter );
+    else
+        resampleImage( (const float *)in, sw, sh, sc, out, dw, dh, dc,
+                filter );
+}
+
+OpenImageIO::ImageBuf *
+convert( OpenImageIO::ImageBuf *sourceBuf, OpenImageIO::ImageSpec spec,
+        ResampleFilter filter )
+{
+    OIIO_NAMESPACE_USING;
+    ImageBuf *resultBuf = new ImageBuf( spec );
+    char *out = (char *)resultBuf->localpixels();
+    if(! sourceBuf ){
+        memset( out, 0, spec.image_bytes() );
+        return resultBuf;
+    }
+
+    // only the two formats smf layers are stored in have kernels
+    if( spec.format != TypeDesc::UINT8 && spec.format != TypeDesc::UINT16 ){
+        delete resultBuf;
+        sourceBuf->read( 0, 0, true, spec.format );
+        ImageBuf *tempBuf = channels( sourceBuf, spec );
+        resultBuf = scale( tempBuf, spec );
+        delete tempBuf;
+        return resultBuf;
+    }
+
+    // read in whatever format the source has
+    sourceBuf->read( 0, 0, true );
+    const ImageSpec &sourceSpec = sourceBuf->spec();
+    TypeDesc format = sourceSpec.format;
+    const void *in = sourceBuf->localpixels();
+
+    // anything but 8 and 16 bit integers is read as float
+    std::vector< float > floats;
+    if(! in || (format != TypeDesc::UINT8 && format != TypeDesc::UINT16) ){
+        floats.resize( sourceSpec.image_pixels() * sourceSpec.nchannels );
+        sourceBuf->get_pixels( sourceBuf->roi(), TypeDesc::FLOAT,
+                floats.data() );
+        in = floats.data();
+        format = TypeDesc::FLOAT;
+    }
+
+    if( spec.format == TypeDesc::UINT8 )
+        convertFrom( in, format, sourceSpec.width, sourceSpec.height,
+                sourceSpec.nchannels, (uint8_t *)out,
+                spec.width, spec.height, spec.nchannels, filter );
+    else
+        convertFrom( in, format, sourceSpec.width, sourceSpec.height,
+                sourceSpec.nchannels, (uint16_t *)out,
+                spec.width, spec.height, spec.nchannels, filter );
+
+#ifdef DEBUG_IMG
+    static int i = 0;
+    resultBuf->write("SMF::convert_" + to_string(i) + ".tif", "tif");
+    i++;
+#endif //DEBUG_IMG
+    return resultBuf;
+}
@@ -47,5 +47,24 @@ OpenImageIO::ImageBuf *channels( OpenImageIO::ImageBuf *sourceBuf,
  */
 OpenImageIO::ImageBuf *scale( OpenImageIO::ImageBuf *sourceBuf,
         OpenImageIO::ImageSpec spec );
+
+/// How convert() picks output pixels when the size changes
+enum ResampleFilter {
+    NEAREST,  //< the source pixel under the centre of the output pixel
+    MAJORITY  //< the most common source pixel, for categorical data
+};
+
+/// Converts an ImageBuf to the format, channels and size of spec in one go
+/*  Equivalent to a format converting read followed by channels() and
+ *  scale(), but the source is read once and every output pixel written
+ *  once, with no intermediate images. When shrinking, MAJORITY gives each
+ *  output pixel the most common value it covers, so categorical layers
+ *  like terrain types never get values that are not in the source.
+ *  8 and 16 bit sources and targets take fast paths, anything else is
+ *  read as float first. If sourceBuf is NULL then a blank image is
+ *  returned.
+ */
+OpenImageIO::ImageBuf *convert( OpenImageIO::ImageBuf *sourceBuf,
+        OpenImageIO::ImageSpec spec, ResampleFilter filter = NEAREST );
    
 #endif //UTIL_H